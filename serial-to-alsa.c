@@ -26,6 +26,8 @@
 #include <stdio.h>
 #include <stdarg.h>
 #include <stdint.h>
+#include <inttypes.h>
+#include <limits.h>
 #include <string.h>
 #include <assert.h>
 
@@ -36,7 +38,27 @@
 #include <unistd.h>
 #include <termios.h>
 #include <pthread.h>
-#include <sys/select.h>
+#include <sched.h>
+#include <stdatomic.h>
+#include <poll.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/inotify.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/signalfd.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/un.h>
+#include <linux/serial.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#elif defined(__ARM_NEON)
+#include <arm_neon.h>
+#endif
 
 #include <alsa/asoundlib.h>
 
@@ -47,40 +69,578 @@
 #define COLOR_YELLOW	"\033[33m"
 #define COLOR_RESET	"\033[0m"
 
+#define ARRAY_SIZE(a) (sizeof(a) / sizeof((a)[0]))
+
 #define eprint(format, ...)						\
 	fprintf(stderr, COLOR_RED format COLOR_RESET, ##__VA_ARGS__);	\
 	putc('\n', stderr)
 
+/*
+ * The n_tty line discipline never returns more than this in one read, and
+ * in raw mode longer frames are split like it would split them.
+ */
+#define READ_SIZE 4096
+
+/*
+ * termios2 lets the driver pick any baud rate, not only the Bxxx ones.
+ * <asm/termbits.h> can't be included along with <termios.h>, so this is its
+ * asm-generic layout, the one ARM and x86 use.
+ */
+#ifndef BOTHER
+#define BOTHER 0010000
+#endif
+#ifndef IBSHIFT
+#define IBSHIFT 16 /* input speed bits, when it differs from output */
+#endif
+
+struct termios2 {
+	tcflag_t c_iflag;
+	tcflag_t c_oflag;
+	tcflag_t c_cflag;
+	tcflag_t c_lflag;
+	cc_t c_line;
+	cc_t c_cc[19];
+	speed_t c_ispeed;
+	speed_t c_ospeed;
+};
+
+/* how the tty finds the end of a frame */
+enum sta_serial_mode {
+	SERIAL_RAW,       /* we split frames ourselves */
+	SERIAL_CANONICAL, /* n_tty hands us one line per read() */
+};
+
+static const char * const serial_mode_names[] = {
+	[SERIAL_RAW]       = "raw",
+	[SERIAL_CANONICAL] = "canonical",
+};
+
+/* how frames are encoded on the wire, all but sentinel need raw mode */
+enum sta_framing {
+	FRAMING_SENTINEL, /* STM32: ends with 0xFF, 0x0A is sent as 0xFA */
+	FRAMING_COBS,     /* consistent overhead byte stuffing, ends with 0x00 */
+	FRAMING_SLIP,     /* RFC 1055, ends with 0xC0 */
+	FRAMING_LENGTH,   /* big-endian 16-bit length, then the frame */
+};
+
+static const char * const framing_names[] = {
+	[FRAMING_SENTINEL] = "sentinel",
+	[FRAMING_COBS]     = "cobs",
+	[FRAMING_SLIP]     = "slip",
+	[FRAMING_LENGTH]   = "length",
+};
+
+/* byte ending a frame, for the framings that have one */
+static const uint8_t framing_delim[] = {
+	[FRAMING_SENTINEL] = 0xFF,
+	[FRAMING_COBS]     = 0x00,
+	[FRAMING_SLIP]     = 0xC0,
+};
+
+/*
+ * Optional trailer checked once a frame is decoded. Both are MSB first and
+ * not reflected, the way the STM32 CRC unit computes them: CRC-8/SMBUS
+ * (polynomial 0x07, init 0x00) and CRC-16/CCITT-FALSE (polynomial 0x1021,
+ * init 0xFFFF, sent big-endian).
+ */
+enum sta_crc {
+	CRC_NONE,
+	CRC_8,
+	CRC_16,
+};
+
+static const char * const crc_names[] = {
+	[CRC_NONE] = "none",
+	[CRC_8]    = "crc8",
+	[CRC_16]   = "crc16",
+};
+
+static const size_t crc_sizes[] = {
+	[CRC_NONE] = 0,
+	[CRC_8]    = 1,
+	[CRC_16]   = 2,
+};
+
+#define SLIP_END     0xC0
+#define SLIP_ESC     0xDB
+#define SLIP_ESC_END 0xDC
+#define SLIP_ESC_ESC 0xDD
+
+/* what the SERIAL thread does with a frame when the queue is full */
+enum sta_overflow {
+	OVERFLOW_BLOCK,
+	OVERFLOW_DROP_OLDEST,
+	OVERFLOW_DROP_NEWEST,
+	OVERFLOW_COALESCE,
+};
+
+static const char * const overflow_names[] = {
+	[OVERFLOW_BLOCK]       = "block",
+	[OVERFLOW_DROP_OLDEST] = "drop-oldest",
+	[OVERFLOW_DROP_NEWEST] = "drop-newest",
+	[OVERFLOW_COALESCE]    = "coalesce",
+};
+
+enum {
+	T_ALSA,
+	T_SERIAL,
+	/* return path, with --return */
+	T_MIDI_IN,
+	T_SERIAL_OUT,
+	T_COUNT,
+};
+
+static const char * const thread_names[] = {
+	[T_ALSA]       = "ALSA",
+	[T_SERIAL]     = "SERIAL",
+	[T_MIDI_IN]    = "MIDI IN",
+	[T_SERIAL_OUT] = "SERIAL OUT",
+};
+
+enum sta_engine {
+	ENGINE_THREADS,
+	ENGINE_EPOLL,
+};
+
+static const char * const engine_names[] = {
+	[ENGINE_THREADS] = "threads",
+	[ENGINE_EPOLL]   = "epoll",
+};
+
+/* what the frames are written to on the ALSA side */
+enum sta_backend {
+	BACKEND_RAWMIDI,
+	BACKEND_SEQ,
+};
+
+static const char * const backend_names[] = {
+	[BACKEND_RAWMIDI] = "rawmidi",
+	[BACKEND_SEQ]     = "seq",
+};
+
+/*
+ * What a MIDI port is with the rawmidi backend: a rawmidi port unless its
+ * name starts with one of the others and a colon, then the rest is a path.
+ */
+enum sta_sink {
+	SINK_RAWMIDI,
+	SINK_FILE,   /* a regular file, that never stalls */
+	SINK_FIFO,   /* a named pipe */
+	SINK_SOCKET, /* a bound UNIX datagram socket, a datagram per message */
+	SINK_NULL,   /* nowhere, only counted */
+};
+
+static const char * const sink_names[] = {
+	[SINK_RAWMIDI] = "rawmidi",
+	[SINK_FILE]    = "file",
+	[SINK_FIFO]    = "fifo",
+	[SINK_SOCKET]  = "unix",
+	[SINK_NULL]    = "null",
+};
+
+/* most datagrams a single sendmmsg() sends for a socket sink */
+#define SINK_MSGS 64
+
+struct sta_sched {
+	int policy; /* SCHED_OTHER, SCHED_FIFO or SCHED_RR */
+	int priority;
+	cpu_set_t cpus;
+	bool pinned;
+};
+
+/* most rawmidi ports a frame can be copied to */
+#define OUTPUT_MAX 8
+
 struct sta_option {
-	char *midi_port_name;
+	/* the return path reads from the first one */
+	char *midi_ports[OUTPUT_MAX];
+	size_t midi_port_count;
 	char *serial_port_name;
+	/* many serial ports instead, with the epoll engine */
+	char *config;
+	size_t workers;
+	unsigned long baud_rate;
+	bool reconnect;
+	bool rtscts;
+	bool ret; /* ALSA input back to the serial port too */
+	bool low_latency;
+	size_t rx_trigger; /* bytes, 0 leaves it alone */
+	size_t buffer_size;
+	enum sta_serial_mode serial_mode;
+	enum sta_framing framing;
+	enum sta_crc crc;
+	unsigned char vmin;
+	unsigned char vtime; /* tenths of a second */
+	enum sta_overflow overflow;
+	enum sta_engine engine;
+	enum sta_backend backend;
+	unsigned long seq_delay; /* us, 0 sends events right away */
+	/* rawmidi kernel buffer, 0 leaves the driver's default */
+	size_t alsa_buffer;
+	size_t alsa_avail_min;
+	bool no_active_sensing;
+	size_t batch_size;
+	unsigned long batch_wait; /* us */
+	bool collapse;
+	bool quiet;
+	bool realtime;
+	struct sta_sched sched[T_COUNT];
 };
 
 static struct sta_option options = {
-	.midi_port_name = "hw:1,0",
+	.midi_ports = { "hw:1,0" },
+	.midi_port_count = 1,
 	.serial_port_name = "/dev/ttymxc1",
+	.workers = 1,
+	.baud_rate = 230400,
+	.reconnect = true,
+	.rx_trigger = 1,
+	.buffer_size = 65536,
+	.serial_mode = SERIAL_RAW,
+	.framing = FRAMING_SENTINEL,
+	.crc = CRC_NONE,
+	.vmin = 1,
+	.vtime = 0,
+	.overflow = OVERFLOW_DROP_NEWEST,
+	.engine = ENGINE_THREADS,
+	.backend = BACKEND_RAWMIDI,
+	.seq_delay = 1000,
+	.batch_size = READ_SIZE,
+	.batch_wait = 0,
+	.sched = {
+		[T_ALSA]       = { .policy = SCHED_OTHER },
+		[T_SERIAL]     = { .policy = SCHED_OTHER },
+		[T_MIDI_IN]    = { .policy = SCHED_OTHER },
+		[T_SERIAL_OUT] = { .policy = SCHED_OTHER },
+	},
+};
+
+/*
+ * -R priorities, the SERIAL thread must preempt the ALSA thread. The return
+ * path gets one below the lowest of them, see rt_return_sched().
+ */
+#define RT_PRIORITY_SERIAL 80
+#define RT_PRIORITY_ALSA   79
+/* locked stack of each thread in real-time mode */
+#define RT_STACK_SIZE (256 * 1024)
+#define RT_STACK_PREFAULT (64 * 1024)
+
+#define CACHELINE 64
+
+/* how often the sequencer queue's clock is mapped to ours again */
+#define SEQ_SYNC_NS 1000000000ull
+
+/* how often the rawmidi kernel buffer is looked at, at most */
+#define STATUS_SAMPLE_NS 1000000ull
+
+/* how often a lost serial port that can't be watched is looked for */
+#define RETRY_MS 1000
+
+/*
+ * Single-producer/single-consumer byte ring of frames. Each frame is stored
+ * as a record made of a 16-bit length, a struct sta_stamp in RING_STAMP bytes
+ * and the frame itself. Records
+ * never wrap: if one doesn't fit before the end of the buffer the producer
+ * leaves a RING_PAD marker (or fewer than RING_HDR bytes) and starts again
+ * at offset 0.
+ *
+ * head and the tail of each cursor are free running byte counters. The
+ * SERIAL thread is the only writer of head and publishes a record with a
+ * release store of it. Every ALSA output has a cursor of its own: it copies
+ * the oldest record it didn't send yet out and then takes it by moving its
+ * tail past it with a compare-and-swap. A record's room is only reused once
+ * every cursor is past it, so a frame is queued once whatever the number of
+ * outputs. The SERIAL thread may also move a tail with a compare-and-swap to
+ * drop the oldest record and reuse its space; if that happens while the
+ * ALSA side is copying, the copy may be torn but its compare-and-swap fails
+ * and the copy is thrown away. Neither side ever waits for the other.
+ */
+#define RING_HDR sizeof(uint16_t)
+#define RING_PAD UINT16_MAX
+/* 64-bit read time, then the time it was queued as 32-bit ns after that */
+#define RING_STAMP (sizeof(uint64_t) + sizeof(uint32_t))
+
+/* CLOCK_MONOTONIC_RAW nanoseconds of a frame going through the bridge */
+struct sta_stamp {
+	uint64_t read;     /* read() returned it */
+	uint64_t queued;   /* pushed to the ring */
+	uint64_t dequeued; /* taken off the ring */
 };
 
+struct sta_cursor {
+	_Alignas(CACHELINE) atomic_size_t tail;
+	/* its consumer can't get rid of what it took, see ring_lag() */
+	atomic_bool stalled;
+	/* frames the SERIAL thread took off it meanwhile */
+	atomic_uint_fast64_t lagged;
+};
+
+struct sta_ring {
+	_Alignas(CACHELINE) atomic_size_t head;
+	struct sta_cursor cursors[OUTPUT_MAX];
+	size_t count; /* of cursors */
+	_Alignas(CACHELINE) uint8_t *data;
+	size_t size; /* power of two */
+};
+
+/*
+ * Log-linear latency histogram in nanoseconds, like HdrHistogram: every power
+ * of two is split into HIST_SUB buckets, so a bucket is never wider than
+ * 1/HIST_SUB of its value. Anything above 2^HIST_MAX_BITS ns lands in the
+ * last bucket.
+ */
+#define HIST_SUB_BITS 4
+#define HIST_SUB (1 << HIST_SUB_BITS)
+#define HIST_MAX_BITS 36
+#define HIST_BUCKETS ((HIST_MAX_BITS - HIST_SUB_BITS + 1) << HIST_SUB_BITS)
+
+/*
+ * Stages of a frame, all measured by the writing side: the ALSA side for
+ * frames from the serial port, the SERIAL OUT side for the return path.
+ */
 enum {
-	T_ALSA,
-	T_SERIAL,
-	T_COUNT,
+	L_QUEUE,     /* read -> queued */
+	L_WAIT,      /* queued -> dequeued */
+	L_SEND,      /* dequeued -> written */
+	L_TOTAL,     /* read -> written */
+	L_RET_QUEUE,
+	L_RET_WAIT,
+	L_RET_SEND,
+	L_RET_TOTAL,
+	L_COUNT,
+};
+
+static const char * const latency_names[] = {
+	[L_QUEUE]     = "read -> queued",
+	[L_WAIT]      = "queued -> dequeued",
+	[L_SEND]      = "dequeued -> written",
+	[L_TOTAL]     = "read -> written",
+	[L_RET_QUEUE] = "return read -> queued",
+	[L_RET_WAIT]  = "return queued -> dequeued",
+	[L_RET_SEND]  = "return dequeued -> written",
+	[L_RET_TOTAL] = "return read -> written",
+};
+
+/* counters have a single writer, anybody may read them */
+struct sta_stats {
+	atomic_uint_fast64_t reads;
+	atomic_uint_fast64_t frames;
+	atomic_uint_fast64_t malformed;
+	atomic_uint_fast64_t corrupt;
+	atomic_uint_fast64_t blocked;
+	atomic_uint_fast64_t blocked_ns;
+	atomic_uint_fast64_t dropped_oldest;
+	atomic_uint_fast64_t dropped_newest;
+	atomic_uint_fast64_t coalesced;
+	atomic_uint_fast64_t ret_frames;
+	atomic_uint_fast64_t ret_bytes;
+	atomic_uint_fast64_t ret_writes;
+	atomic_uint_fast64_t ret_dropped;
+	atomic_uint_fast64_t ret_xruns;
+};
+
+struct sta_hist {
+	atomic_uint_fast64_t count[HIST_BUCKETS];
+	atomic_uint_fast64_t sum;
+	atomic_uint_fast64_t max;
+};
+
+/*
+ * Controller values that didn't fit in the ring with the coalesce policy.
+ * Only the latest value of each key is kept, in arrival order.
+ */
+#define PENDING_COUNT 64
+
+/* MIDI byte stream parser, cuts the ALSA input into messages */
+struct sta_midi {
+	uint8_t msg[READ_SIZE];
+	size_t len;
+	size_t need;    /* length of the message in progress */
+	bool sysex;     /* in a SysEx, need doesn't apply */
+	uint8_t status; /* running status, 0 if there's none */
+	uint8_t rt;     /* a real-time message that came in between */
+};
+
+/* return path frames, encoded, that the serial port didn't take yet */
+#define TX_SIZE (4 * READ_SIZE)
+/* largest encoded frame: SLIP doubles every byte, plus a CRC and two ENDs */
+#define TX_FRAME_MAX (2 * (READ_SIZE + 2) + 2)
+
+struct sta_pending {
+	uint32_t key;
+	uint8_t len;
+	uint8_t msg[3];
+	uint64_t read;
+};
+
+/*
+ * With --collapse, the controller values of the batch being gathered that a
+ * newer one may still replace, and where they are in it.
+ */
+#define COLLAPSE_COUNT 64
+
+struct sta_collapse {
+	uint32_t key;
+	uint32_t frame;
+	size_t off;
+};
+
+struct sta_userdata;
+struct sta_output;
+
+/* one line of --config: a serial port and the MIDI ports it's routed to */
+struct sta_route {
+	char *serial_port;
+	char *midi_ports[OUTPUT_MAX];
+	size_t midi_port_count;
+};
+
+/*
+ * A MIDI port, opened once however many serial ports are routed to it. Each
+ * of those has an output of its own on it.
+ */
+struct sta_port {
+	const char *name;
+	enum sta_sink sink;
+	/* NULL with the sequencer backend, or a sink */
+	snd_rawmidi_t *rawmidi;
+	/* the sinks' path, past the colon, and their fd */
+	const char *path;
+	int fd;
+	/* poll descriptors, and a spare one for stop_fd */
+	struct pollfd *pfds;
+	int nfds;
+	/* rawmidi kernel buffer size, 0 if we can't look at it */
+	size_t buffer;
+	/* the output it only took part of a batch from, see alsa_write() */
+	struct sta_output *busy;
+	/* an output owes it room, and it's watched for it: epoll engine */
+	bool pending;
+	bool watched;
 };
 
-#define BUF_COUNT 16
-#define BUF_SIZE 256
+/*
+ * Where frames from the serial port go, each with a cursor into the ring
+ * and, with the threads engine, an ALSA thread of its own.
+ */
+struct sta_output {
+	struct sta_userdata *u;
+	struct sta_port *port;
+	size_t cursor;
+	pthread_t t;
+	int data_fd;
+	atomic_bool data_wanted;
+	/* frames gathered for a single snd_rawmidi_write() */
+	uint8_t *batch;
+	struct sta_stamp *batch_stamps;
+	uint16_t *batch_lens;
+	/* a batch the rawmidi port only took part of */
+	size_t batch_len;
+	size_t batch_off;
+	size_t batch_frames;
+	struct sta_collapse collapse[COLLAPSE_COUNT];
+	size_t collapse_count;
+	uint64_t stalled; /* when it stopped taking more, 0 if it didn't */
+	uint64_t status_at;
+	/* bytes written that the kernel didn't send yet */
+	struct sta_hist kernel_queue;
+	uint64_t first_write;
+	uint64_t last_write;
+	/* written by its ALSA side only */
+	atomic_uint_fast64_t sent_frames;
+	atomic_uint_fast64_t sent_bytes;
+	atomic_uint_fast64_t writes;
+	atomic_uint_fast64_t stalls;
+	atomic_uint_fast64_t stalled_ns;
+	atomic_uint_fast64_t seq_late;
+	atomic_uint_fast64_t collapsed;
+	/* L_QUEUE to L_TOTAL */
+	struct sta_hist latency[L_RET_QUEUE];
+};
 
+/* A serial port and the outputs its frames are routed to. */
 struct sta_userdata {
-	snd_rawmidi_t *output;
+	const char *serial_port;
+	struct sta_output outputs[OUTPUT_MAX];
+	size_t output_count;
+	/* sequencer backend, a single output without a rawmidi port */
+	snd_seq_t *seq;
+	snd_midi_event_t *seq_enc;
+	int seq_port;
+	int seq_queue;
+	/* our clock when the queue's was at 0, see seq_sync() */
+	uint64_t seq_base;
+	uint64_t seq_sync;
+	/* queue time of the last event scheduled, see seq_write() */
+	uint64_t seq_last;
+	/* -1 while the port is away, inotify_fd then waits for it */
 	int fd;
+	int inotify_fd;
+	int wd;
+	uint64_t lost;
+	/* raw mode: a frame that hasn't been read whole yet is kept here */
+	uint8_t rx[READ_SIZE];
+	size_t rx_len;
+	/* where the frame delimiters of the last read are */
+	uint16_t eol[READ_SIZE];
 	pthread_t t[T_COUNT];
-	pthread_mutex_t mutex;
-	pthread_cond_t condition;
-	uint8_t buf[BUF_COUNT][BUF_SIZE];
-	size_t buf_count;
+	/*
+	 * Wake-ups: a side that is about to sleep raises its *_wanted flag,
+	 * checks the ring once more and then blocks on its eventfd. The other
+	 * side only writes to the eventfd when it sees the flag raised. Each
+	 * output has its own for data, any of them hands room back.
+	 */
+	int room_fd;
+	/* readable for good once we are asked to stop */
+	int stop_fd;
+	atomic_bool room_wanted;
+	struct sta_ring ring;
+	struct sta_pending pending[PENDING_COUNT];
+	size_t pending_count;
+	bool overflowing;
+	/* the epoll engine waits for any output to have room with these */
+	struct pollfd *wait_pfds;
+	struct sta_stats stats;
+	/* the return path's, the outputs keep their own */
+	struct sta_hist latency[L_COUNT];
+	/*
+	 * Return path: the MIDI IN side parses the ALSA input into the ret
+	 * ring, the SERIAL OUT side encodes it and writes it to out_fd, an fd
+	 * of its own so the reading side can reconnect on its own.
+	 */
+	snd_rawmidi_t *input;
+	struct sta_midi midi;
+	int out_fd;
+	int ret_data_fd;
+	int ret_room_fd;
+	atomic_bool ret_data_wanted;
+	atomic_bool ret_room_wanted;
+	struct sta_ring ret;
+	uint8_t ret_msg[READ_SIZE + 2];
+	uint8_t *tx;
+	size_t tx_len;
+	size_t tx_off;
+	size_t tx_frames;
+	struct sta_stamp *tx_stamps;
+	bool tx_lost;
+};
+
+/*
+ * An epoll engine thread and the serial ports it serves. Those routed to
+ * the same MIDI port are always served by the same one, so a port never
+ * has more than one thread writing to it.
+ */
+struct sta_worker {
+	pthread_t t;
+	size_t index;
+	struct sta_userdata **bridges;
+	size_t count;
+	/* every MIDI port they are routed to, once */
+	struct sta_port **ports;
+	size_t port_count;
 };
 
-static bool stop = false;
+static atomic_bool stop = false;
 
 static void usage()
 {
@@ -88,9 +648,103 @@ static void usage()
 	       "\n"
 	       "-h, --help              this help\n"
 	       "-V, --version           print current version\n"
-	       "-m, --midi-port=name    select port by name (default: hw:1,0)\n"
+	       "-m, --midi-port=name    select port by name (default: hw:1,0), again\n"
+	       "                        to send to up to %d ports: one that stops\n"
+	       "                        taking more loses frames instead of holding\n"
+	       "                        back the others, --overflow applies to those\n"
+	       "                        that keep up; --return reads from the first.\n"
+	       "                        A name may also be a sink other than rawmidi:\n"
+	       "                          file:path  a file, written as fast as it\n"
+	       "                                     takes\n"
+	       "                          fifo:path  a named pipe, stalls once full\n"
+	       "                          unix:path  a bound UNIX datagram socket,\n"
+	       "                                     a datagram per message\n"
+	       "                          null:      nowhere, only counted\n"
 	       "-s, --serial-port=name  select port by name (default: /dev/ttymxc1)\n"
-	       "\n");
+	       "-c, --config=file       many serial ports instead of -s and -m: one per\n"
+	       "                        line followed by the MIDI ports its frames go\n"
+	       "                        to, which other lines may name too; # starts\n"
+	       "                        a comment. Implies the epoll engine\n"
+	       "    --workers=n         epoll threads the serial ports are spread over,\n"
+	       "                        those sharing a MIDI port go to the same one\n"
+	       "                        (default: 1)\n"
+	       "-B, --baud-rate=rate    any rate the UART can do, e.g. 3000000\n"
+	       "                        (default: 230400)\n"
+	       "    --rtscts            hardware flow control: when the queue is full\n"
+	       "                        RTS is dropped instead of losing frames,\n"
+	       "                        implies --overflow=block\n"
+	       "    --no-reconnect      exit when the serial port goes away instead\n"
+	       "                        of waiting for it to come back\n"
+	       "    --low-latency       ask the UART driver for ASYNC_LOW_LATENCY and\n"
+	       "                        an RX FIFO trigger of --rx-trigger bytes\n"
+	       "    --rx-trigger=bytes  implies --low-latency (default: 1, 0 leaves\n"
+	       "                        the driver's level alone)\n"
+	       "-r, --return            also copy the ALSA input to the serial port,\n"
+	       "                        encoded with --framing and --crc\n"
+	       "                        (sentinel drops Start and System Reset)\n"
+	       "    --serial-mode=mode  who splits frames:\n"
+	       "                          raw        us, many per read (default)\n"
+	       "                          canonical  the tty, one per read, only\n"
+	       "                                     with sentinel framing\n"
+	       "    --framing=name      how frames are encoded, raw mode only but for\n"
+	       "                        the first:\n"
+	       "                          sentinel  ends with 0xFF, 0x0A sent as 0xFA\n"
+	       "                                    (default)\n"
+	       "                          cobs      COBS, ends with 0x00\n"
+	       "                          slip      SLIP, ends with 0xC0\n"
+	       "                          length    16-bit big-endian length first\n"
+	       "    --crc=name          check and strip a trailer on every frame, not\n"
+	       "                        with sentinel framing: none (default), crc8\n"
+	       "                        (SMBUS) or crc16 (CCITT-FALSE, big-endian)\n"
+	       "    --vmin=bytes        raw mode: bytes a read waits for (default: 1)\n"
+	       "    --vtime=ds          raw mode: once a byte arrived, how many tenths\n"
+	       "                        of a second a read waits for the next one\n"
+	       "                        (default: 0, wait for --vmin bytes)\n"
+	       "-b, --buffer-size=bytes size of the frame queue (default: 65536)\n"
+	       "-O, --overflow=policy   what to do when the queue is full:\n"
+	       "                          block        stop reading the serial port\n"
+	       "                          drop-oldest  drop the oldest queued frames\n"
+	       "                          drop-newest  drop the incoming frame (default)\n"
+	       "                          coalesce     keep only the latest controller\n"
+	       "                                       values, block for anything else\n"
+	       "-q, --quiet             don't print every MIDI message\n"
+	       "    --batch-size=bytes  most bytes sent in a single write (default: %d)\n"
+	       "    --batch-wait=us     how long a batch that isn't full may wait for\n"
+	       "                        more frames, threads engine only (default: 0)\n"
+	       "    --collapse          once a port falls behind, a newer controller\n"
+	       "                        value replaces the one still waiting in the\n"
+	       "                        batch, never across a note or other message\n"
+	       "                        of its channel\n"
+	       "-e, --engine=name       threads: a SERIAL and an ALSA thread (default)\n"
+	       "                        epoll: a single thread doing both, see\n"
+	       "                        --workers\n"
+	       "    --backend=name      rawmidi: write to --midi-port (default)\n"
+	       "                        seq: a sequencer client of our own that\n"
+	       "                        anybody can subscribe to\n"
+	       "    --seq-delay=us      schedule every event this long after its\n"
+	       "                        frame was read, 0 sends it right away\n"
+	       "                        (default: 1000)\n"
+	       "    --alsa-buffer=bytes rawmidi kernel buffer, the less it holds the\n"
+	       "                        sooner a slow port shows up as stalls\n"
+	       "                        (default: the driver's)\n"
+	       "    --alsa-avail-min=bytes\n"
+	       "                        room the kernel buffer must have before a\n"
+	       "                        stalled write goes on (default: the driver's)\n"
+	       "    --no-active-sensing don't send Active Sensing when closing the port\n"
+	       "-R, --realtime          lock memory and run every thread with SCHED_FIFO\n"
+	       "    --serial-sched=policy[:priority]\n"
+	       "    --alsa-sched=policy[:priority]\n"
+	       "                        scheduling of each thread: other, fifo or rr\n"
+	       "                        (default with -R: fifo:%d and fifo:%d, the\n"
+	       "                        epoll engine uses the SERIAL settings; with\n"
+	       "                        -R, the --return threads run one priority\n"
+	       "                        below both)\n"
+	       "    --serial-cpus=list\n"
+	       "    --alsa-cpus=list     pin each thread to CPUs, e.g. 0,2-3\n"
+	       "\n"
+	       "SIGUSR1 prints the latency of each stage so far, it's also printed at\n"
+	       "exit.\n"
+	       "\n", OUTPUT_MAX, READ_SIZE, RT_PRIORITY_SERIAL, RT_PRIORITY_ALSA);
 }
 
 static void version()
@@ -108,274 +762,4148 @@ static void * sta_malloc(size_t size)
 	return p;
 }
 
-static void sig_handler(int dummy)
+static void * sta_realloc(void *p, size_t size)
 {
-	stop = true;
+	if (!(p = realloc(p, size))) {
+		eprint("out of memory");
+		exit(EXIT_FAILURE);
+	}
+	return p;
 }
 
-static int alsa_setup(snd_rawmidi_t **output /* OUT */)
+static char * sta_strdup(const char *s)
 {
-	int err;
-	if ((err = snd_rawmidi_open(NULL,
-	                            output,
-	                            options.midi_port_name,
-	                            SND_RAWMIDI_NONBLOCK)) < 0) {
-		eprint("ALSA: cannot open port \"%s\": %s",
-		        options.midi_port_name, snd_strerror(err));
-		goto end;
-	}
+	return strcpy(sta_malloc(strlen(s) + 1), s);
+}
 
-	if ((err = snd_rawmidi_nonblock(*output, 0)) < 0) {
-		eprint("ALSA: cannot set blocking mode: %s", snd_strerror(err));
-		goto end;
-	}
+static void stat_add(atomic_uint_fast64_t *c, uint64_t n)
+{
+	atomic_store_explicit(c, atomic_load_explicit(c, memory_order_relaxed) + n,
+	                      memory_order_relaxed);
+}
 
-end:
-	return err;
+static uint64_t stat_get(atomic_uint_fast64_t *c)
+{
+	return atomic_load_explicit(c, memory_order_relaxed);
 }
 
-static int serial_setup(const char *port)
+static void ring_init(struct sta_ring *r, size_t size, size_t cursors)
 {
-	int fd, err;
-	struct termios tio;
+	size_t i;
 
-	if ((fd = open(port, O_RDONLY | O_NOCTTY)) < 0) {
-		eprint("SERIAL: cannot open port \"%s\": %s",
-		        port, strerror(errno));
-		err = fd;
-		goto err;
-	}
+	r->size = 1;
+	while (r->size < size)
+		r->size <<= 1;
 
-	if ((err = tcgetattr(fd, &tio)) < 0) {
-		eprint("SERIAL: cannot get attributes from \"%s\": %s",
-		        port, strerror(errno));
-		goto err;
-	}
+	r->data = sta_malloc(r->size);
+	atomic_init(&r->head, 0);
 
-	tio.c_cflag = CLOCAL | CREAD | CS8;
-	tio.c_iflag = IGNCR | IGNPAR | IGNBRK; /* ignore everything we can */
-	tio.c_lflag = ICANON; /* canonical mode */
-	/* use 0xFF as our end-of-line character */
-	tio.c_cc[VEOL]     = 0xFF;
-	tio.c_cc[VEOL2]    = 0xFF;
-	/* map everything else to a value we'll never see */
-	tio.c_cc[VEOF]     = 0xFE;
-	tio.c_cc[VERASE]   = 0xFE;
-	tio.c_cc[VKILL]    = 0xFE;
-	tio.c_cc[VLNEXT]   = 0xFE;
-	tio.c_cc[VREPRINT] = 0xFE;
-	tio.c_cc[VWERASE]  = 0xFE;
-
-	if ((err = cfsetspeed(&tio, B230400)) < 0) {
-		eprint("SERIAL: cannot set speed attribute for \"%s\": %s",
-		        port, strerror(errno));
-		goto err;
+	r->count = cursors;
+	for (i = 0; i < cursors; i++) {
+		atomic_init(&r->cursors[i].tail, 0);
+		atomic_init(&r->cursors[i].stalled, false);
+		atomic_init(&r->cursors[i].lagged, 0);
 	}
+}
 
-	/* try: TCSANOW */
-	if ((err = tcsetattr (fd, TCSAFLUSH, &tio)) < 0) {
-		eprint("SERIAL: cannot set attributes for \"%s\": %s",
-		        port, strerror(errno));
-		goto err;
-	}
+static void ring_free(struct sta_ring *r)
+{
+	free(r->data);
+	r->data = NULL;
+}
 
-	fsync(fd);
-	tcflush(fd, TCIFLUSH);
+/* Whether the consumer of cursor c has nothing left to take. */
+static bool ring_empty(struct sta_ring *r, size_t c)
+{
+	return atomic_load_explicit(&r->head, memory_order_acquire) ==
+	       atomic_load(&r->cursors[c].tail);
+}
 
-	return fd;
+/* Producer: the tail of the cursor furthest behind, head if none is. */
+static size_t ring_tail(struct sta_ring *r, size_t head)
+{
+	size_t i, used = 0;
 
-err:
-	if (fd > 0)
-		close(fd);
+	/* free running, so compare how far each one is from head */
+	for (i = 0; i < r->count; i++) {
+		size_t n = head - atomic_load(&r->cursors[i].tail);
 
-	return err;
+		if (n > used)
+			used = n;
+	}
+
+	return head - used;
 }
 
-static void * alsa_worker(void *data)
+/* Bytes in use, as seen by the producer. */
+static size_t ring_used(struct sta_ring *r)
 {
-	struct sta_userdata *u = data;
+	size_t head = atomic_load_explicit(&r->head, memory_order_relaxed);
 
-	assert(u);
+	return head - ring_tail(r, head);
+}
 
-	pthread_setname_np(pthread_self(), "ALSA Thread");
+/* Size of the padding at pos, if the record there was moved to offset 0. */
+static size_t ring_pad(struct sta_ring *r, size_t pos)
+{
+	size_t off = pos & (r->size - 1);
+	uint16_t hdr;
 
-	while (!stop) {
-		size_t i;
+	if (r->size - off < RING_HDR)
+		return r->size - off;
 
-		if (pthread_mutex_lock(&u->mutex) != 0) {
-			eprint("THREAD: cannot lock mutex in ALSA thread: %s",
-			        strerror(errno));
-			stop = true;
-		}
+	memcpy(&hdr, r->data + off, RING_HDR);
+	return hdr == RING_PAD ? r->size - off : 0;
+}
 
-		if (pthread_cond_wait(&u->condition, &u->mutex) != 0) {
-			eprint("THREAD: cannot wait for condition variable in "
-			        "ALSA thread: %s", strerror(errno));
-			stop = true;
-			goto mutex;
-		}
+static size_t ring_len(struct sta_ring *r, size_t pos)
+{
+	uint16_t hdr;
 
-		if (stop)
-			goto mutex;
+	memcpy(&hdr, r->data + (pos & (r->size - 1)), RING_HDR);
+	return hdr;
+}
 
-		if (u->buf_count == 0) {
-			eprint("SERIAL: Buffer underflow...");
-			fflush(stderr);
-			goto mutex;
-		}
+static uint64_t time_ns(void)
+{
+	struct timespec ts;
 
-		for (i = 0; i < u->buf_count; i++) {
-			size_t j;
-			int err;
+	/* not slewed by NTP, and still served by the vDSO */
+	clock_gettime(CLOCK_MONOTONIC_RAW, &ts);
+	return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
 
-			printf(COLOR_GREEN "MIDI --> ");
+/*
+ * Producer: copies a frame read at the given time into the ring, stamping it
+ * as queued now. Returns false if it is full.
+ */
+static bool ring_push(struct sta_ring *r, const uint8_t *buf, size_t len,
+                      uint64_t read)
+{
+	size_t head = atomic_load_explicit(&r->head, memory_order_relaxed);
+	size_t tail = ring_tail(r, head);
+	size_t off = head & (r->size - 1);
+	size_t need = RING_HDR + RING_STAMP + len;
+	size_t skip = 0;
+	uint16_t hdr = len;
+	uint64_t queued;
 
-			j = 0;
-			/* Don't send the 0xFF at then end */
-			while (u->buf[i][j] != 0xFF) {
-				printf("%02x ", u->buf[i][j]);
-				j++;
-			}
+	assert(len < RING_PAD);
 
-			if (j == 0) {
-				printf("nothing to send");
-			}
+	if (r->size - off < need)
+		skip = r->size - off;
 
-			printf("\n" COLOR_RESET);
-			fflush(stdout);
+	if (r->size - (head - tail) < skip + need)
+		return false;
 
-			if ((j > 0) &&
-			    ((err = snd_rawmidi_write(u->output, u->buf[i], j)) < 0)) {
-				eprint("ALSA: cannot send data: %s",
-				        snd_strerror(err));
-				continue;
-			}
+	if (skip) {
+		if (skip >= RING_HDR) {
+			hdr = RING_PAD;
+			memcpy(r->data + off, &hdr, RING_HDR);
+			hdr = len;
 		}
+		off = 0;
+	}
 
-		u->buf_count = 0;
+	queued = time_ns() - read;
+	if (queued > UINT32_MAX)
+		queued = UINT32_MAX;
 
-	mutex:
-		if (pthread_mutex_unlock(&u->mutex) != 0) {
-			eprint("THREAD: cannot unlock mutex in ALSA thread: %s",
-			        strerror(errno));
-			pthread_kill(u->t[T_SERIAL], 9);
-			stop = true;
-		}
-	}
+	memcpy(r->data + off, &hdr, RING_HDR);
+	memcpy(r->data + off + RING_HDR, &read, sizeof(read));
+	memcpy(r->data + off + RING_HDR + sizeof(read), &(uint32_t) { queued },
+	       sizeof(uint32_t));
+	memcpy(r->data + off + RING_HDR + RING_STAMP, buf, len);
 
-	return NULL;
+	atomic_store_explicit(&r->head, head + skip + need,
+	                      memory_order_release);
+	return true;
 }
 
-static void * serial_worker(void *data)
+/*
+ * Producer: moves the cursors still on the record at tail past it. A cursor
+ * that moved meanwhile took the frame itself.
+ */
+static void ring_skip(struct sta_ring *r, size_t tail, bool lagged)
 {
-	struct sta_userdata *u = data;
+	/* only we reuse room, so this record stays as it is */
+	size_t skip = ring_pad(r, tail);
+	size_t next = tail + skip + RING_HDR + RING_STAMP +
+	              ring_len(r, tail + skip);
+	size_t i;
 
-	assert(u);
+	for (i = 0; i < r->count; i++) {
+		size_t t = tail;
 
-	pthread_setname_np(pthread_self(), "SERIAL Thread");
+		if (atomic_compare_exchange_strong(&r->cursors[i].tail, &t,
+		                                   next) && lagged)
+			stat_add(&r->cursors[i].lagged, 1);
+	}
+}
 
-	while (!stop) {
-		size_t len, err;
-		fd_set rfds;
-		struct timeval tv;
+/* Producer: drops the oldest frame. Returns false if none is left. */
+static bool ring_drop(struct sta_ring *r)
+{
+	size_t head = atomic_load_explicit(&r->head, memory_order_relaxed);
+	size_t tail = ring_tail(r, head);
 
-		FD_ZERO(&rfds);
-		FD_SET(u->fd, &rfds);
+	if (tail == head)
+		return false;
 
-		tv.tv_sec = 0;
-		tv.tv_usec = 5000;
+	ring_skip(r, tail, false);
+	return true;
+}
 
-		while ((err = select(FD_SETSIZE, &rfds, NULL, NULL, &tv)) <= 0) {
-			if (err == -1) {
-				eprint("THREAD: cannot wait for terminal in SERIAL "
-				        "thread: %s", strerror(errno));
-				stop = true;
-				goto cond;
-			} else {
-				/* check if SIGINT was triggered */
-				if (stop)
-					goto cond;
+/*
+ * Producer: drops the oldest frame off the cursors furthest behind, if all
+ * of their consumers are stalled while another one isn't: they just lag
+ * behind it, and must not hold it back. Returns false if nothing was
+ * dropped.
+ */
+static bool ring_lag(struct sta_ring *r)
+{
+	size_t head = atomic_load_explicit(&r->head, memory_order_relaxed);
+	size_t tail = ring_tail(r, head);
+	bool moving = false;
+	size_t i;
 
-				/* reset flags because select updates them */
-				FD_ZERO(&rfds);
-				FD_SET(u->fd, &rfds);
+	if (tail == head)
+		return false;
 
-				tv.tv_sec = 0;
-				tv.tv_usec = 5000;
-			}
-		}
+	for (i = 0; i < r->count; i++) {
+		bool stalled = atomic_load(&r->cursors[i].stalled);
 
-		if (pthread_mutex_lock(&u->mutex) != 0) {
-			eprint("THREAD: cannot lock mutex in SERIAL thread: %s",
-			        strerror(errno));
-			stop = true;
+		if (atomic_load(&r->cursors[i].tail) == tail) {
+			if (!stalled)
+				return false;
+		} else if (!stalled) {
+			moving = true;
 		}
+	}
 
-		if (u->buf_count == BUF_COUNT) {
-			eprint("SERIAL: Buffer overflow... ignore MIDI messages");
-			fflush(stderr);
-			/* discards the data in the terminal input queue */
-			tcflush(u->fd, TCIFLUSH);
-			goto mutex;
-		}
+	if (!moving)
+		return false;
+
+	ring_skip(r, tail, true);
+	return true;
+}
+
+/* Consumer: tells the producer whether it's stuck with what it took. */
+static void ring_stall(struct sta_ring *r, size_t c, bool stalled)
+{
+	atomic_store(&r->cursors[c].stalled, stalled);
+}
+
+/*
+ * Consumer: copies the oldest frame cursor c didn't take yet into buf and
+ * its read and queued times into stamp, and takes it. Returns its length,
+ * -EAGAIN if there is none or -ENOBUFS if the frame is larger than size, in
+ * which case it is left on the ring.
+ */
+static ssize_t ring_pop(struct sta_ring *r, size_t c, uint8_t *buf,
+                        size_t size, struct sta_stamp *stamp /* OUT */)
+{
+	atomic_size_t *cursor = &r->cursors[c].tail;
+	size_t tail = atomic_load(cursor);
+
+	for (;;) {
+		size_t head = atomic_load_explicit(&r->head,
+		                                   memory_order_acquire);
+		size_t skip, off, len;
+		uint32_t queued;
+
+		if (head == tail)
+			return -EAGAIN;
 
-		if ((len = read(u->fd, u->buf[u->buf_count], sizeof(*u->buf))) > 0) {
-			size_t i;
-			printf(COLOR_YELLOW "MIDI <-- ");
+		/*
+		 * If the SERIAL thread drops this record meanwhile what we read
+		 * may be garbage, but then tail moves: the compare-and-swap
+		 * fails and we try again from the new tail.
+		 */
+		skip = ring_pad(r, tail);
+		off = (tail + skip) & (r->size - 1);
+		len = ring_len(r, tail + skip);
 
-			for (i = 0; i < (len - 1); i++) {
-				/* STM32 internal protocol */
-				if (u->buf[u->buf_count][i] == 0xFA)
-					u->buf[u->buf_count][i] = 0x0A;
-				printf("%02x ", u->buf[u->buf_count][i]);
+		if (off + RING_HDR + RING_STAMP + len > r->size || len > size) {
+			size_t now;
+
+			/*
+			 * The header was a plain read: it must be done with
+			 * before tail is looked at again, or on a weakly
+			 * ordered CPU a torn one may pass for real.
+			 */
+			atomic_thread_fence(memory_order_acquire);
+			now = atomic_load(cursor);
+
+			/* tail didn't move, so it's a real record */
+			if (now == tail) {
+				assert(off + RING_HDR + RING_STAMP + len <=
+				       r->size);
+				return -ENOBUFS;
 			}
-			printf("\n" COLOR_RESET);
-			fflush(stdout);
-			u->buf_count++;
 
-		} else {
-			eprint("SERIAL: cannot read from \"%s\": %s",
-			        options.serial_port_name, strerror(errno));
-			stop = true;
+			tail = now;
+			continue;
 		}
 
-	mutex:
-		if (pthread_mutex_unlock(&u->mutex) != 0) {
-			eprint("THREAD: cannot unlock mutex in SERIAL thread: %s",
-			        strerror(errno));
-			pthread_kill(u->t[T_ALSA], 9);
-			stop = true;
-		}
+		memcpy(&stamp->read, r->data + off + RING_HDR,
+		       sizeof(stamp->read));
+		memcpy(&queued, r->data + off + RING_HDR + sizeof(stamp->read),
+		       sizeof(queued));
+		memcpy(buf, r->data + off + RING_HDR + RING_STAMP, len);
 
-	cond:
-		if (pthread_cond_signal(&u->condition) != 0) {
-			eprint("THREAD: cannot signal condition variable in "
-			        "SERIAL thread: %s", strerror(errno));
-			pthread_kill(u->t[T_ALSA], 9);
-			stop = true;
+		if (atomic_compare_exchange_weak(cursor, &tail,
+		                                 tail + skip + RING_HDR +
+		                                 RING_STAMP + len)) {
+			stamp->queued = stamp->read + queued;
+			return len;
 		}
 	}
+}
 
-	return NULL;
+static void hist_init(struct sta_hist *h)
+{
+	size_t i;
+
+	for (i = 0; i < HIST_BUCKETS; i++)
+		atomic_init(&h->count[i], 0);
+	atomic_init(&h->sum, 0);
+	atomic_init(&h->max, 0);
 }
 
-int main(int argc, char *argv[])
+static size_t hist_index(uint64_t v)
 {
-	static const char short_options[] = "hVm:s:";
-	static const struct option long_options[] = {
-		{"help", no_argument, NULL, 'h'},
-		{"version", no_argument, NULL, 'V'},
-		{"midi-port", required_argument, NULL, 'm'},
-		{"serial-port", required_argument, NULL, 's'},
-		{ }
-	};
-	int c, err;
-	struct sta_userdata u;
-	pthread_mutexattr_t atts;
+	int shift;
 
-	u.buf_count = 0;
+	if (v < HIST_SUB)
+		return v;
+	if (v >> HIST_MAX_BITS)
+		return HIST_BUCKETS - 1;
 
-	while ((c = getopt_long(argc, argv, short_options,
+	/* v >> shift keeps the top HIST_SUB_BITS + 1 bits */
+	shift = 63 - __builtin_clzll(v) - HIST_SUB_BITS;
+	return ((size_t) shift << HIST_SUB_BITS) + (v >> shift);
+}
+
+/* Lowest value counted in bucket i. */
+static uint64_t hist_value(size_t i)
+{
+	int shift = (i >> HIST_SUB_BITS) - 1;
+
+	if (shift < 0)
+		return i;
+
+	return (uint64_t) ((i & (HIST_SUB - 1)) | HIST_SUB) << shift;
+}
+
+/* Only the ALSA side records, so this is a handful of plain stores. */
+static void hist_add(struct sta_hist *h, uint64_t v)
+{
+	stat_add(&h->count[hist_index(v)], 1);
+	stat_add(&h->sum, v);
+	if (v > stat_get(&h->max))
+		atomic_store_explicit(&h->max, v, memory_order_relaxed);
+}
+
+/*
+ * Returns a key identifying what a frame made of a single controller-like
+ * MIDI message controls, so a newer value can replace an older one, or 0
+ * for anything else.
+ */
+static uint32_t midi_coalesce_key(const uint8_t *buf, size_t len)
+{
+	if (len == 3) {
+		switch (buf[0] & 0xF0) {
+		case 0xB0: /* control change */
+			/*
+			 * Data entry means whatever the (N)RPN selected before
+			 * says, MPE configuration included: keep all of it.
+			 */
+			if (buf[1] == 6 || buf[1] == 38 ||
+			    (buf[1] >= 96 && buf[1] <= 101))
+				return 0;
+			/*
+			 * Channel mode messages, e.g. All Sound Off or Reset
+			 * All Controllers, act on every value before them:
+			 * none may move ahead of one.
+			 */
+			if (buf[1] >= 120)
+				return 0;
+			/* fall through */
+		case 0xA0: /* polyphonic key pressure */
+			return 1 << 16 | buf[0] << 8 | buf[1];
+		case 0xE0: /* pitch bend */
+			return 1 << 16 | buf[0] << 8;
+		}
+	} else if (len == 2 && (buf[0] & 0xF0) == 0xD0) {
+		/* channel pressure */
+		return 1 << 16 | buf[0] << 8;
+	}
+
+	return 0;
+}
+
+/*
+ * Feeds a byte of the ALSA input to the parser. Returns the length of the
+ * message it completed, which *msg then points to, or 0. Real-time messages
+ * come out on their own even in the middle of another one, and a SysEx too
+ * long for the buffer comes out in pieces.
+ */
+static size_t midi_parse(struct sta_midi *p, uint8_t b, const uint8_t **msg)
+{
+	size_t len;
+
+	*msg = p->msg;
+
+	if (b >= 0xF8) {
+		p->rt = b;
+		*msg = &p->rt;
+		return 1;
+	}
+
+	if (b == 0xF7) {
+		if (!p->sysex)
+			return 0;
+
+		p->msg[p->len++] = b;
+		len = p->len;
+		p->len = 0;
+		p->sysex = false;
+		return len;
+	}
+
+	if (b & 0x80) {
+		/* a SysEx cut short by another status byte is lost */
+		p->sysex = false;
+		p->msg[0] = b;
+		p->len = 1;
+
+		switch (b) {
+		case 0xF0:
+			p->sysex = true;
+			p->status = 0;
+			return 0;
+		case 0xF1: /* MTC quarter frame */
+		case 0xF3: /* song select */
+			p->status = 0;
+			p->need = 2;
+			return 0;
+		case 0xF2: /* song position */
+			p->status = 0;
+			p->need = 3;
+			return 0;
+		case 0xF6: /* tune request */
+			p->status = 0;
+			p->len = 0;
+			return 1;
+		case 0xF4:
+		case 0xF5:
+			/* undefined */
+			p->status = 0;
+			p->len = 0;
+			return 0;
+		default:
+			p->status = b;
+			p->need = (b & 0xE0) == 0xC0 ? 2 : 3;
+			return 0;
+		}
+	}
+
+	if (p->sysex) {
+		p->msg[p->len++] = b;
+
+		/* keep room for the 0xF7 */
+		if (p->len < sizeof(p->msg) - 1)
+			return 0;
+
+		len = p->len;
+		p->len = 0;
+		return len;
+	}
+
+	if (p->len == 0) {
+		/* nothing to add it to */
+		if (!p->status)
+			return 0;
+
+		p->msg[0] = p->status;
+		p->len = 1;
+	}
+
+	p->msg[p->len++] = b;
+	if (p->len < p->need)
+		return 0;
+
+	len = p->len;
+	p->len = 0;
+	return len;
+}
+
+static bool parse_size(const char *arg, size_t *val /* OUT */)
+{
+	char *end;
+	unsigned long long v;
+
+	errno = 0;
+	v = strtoull(arg, &end, 0);
+	if (errno || end == arg || *end != '\0' || v > SIZE_MAX)
+		return false;
+
+	*val = v;
+	return true;
+}
+
+static bool parse_sched(const char *arg, struct sta_sched *sched /* OUT */)
+{
+	const char *prio = strchr(arg, ':');
+	size_t len = prio ? (size_t) (prio - arg) : strlen(arg);
+	size_t val;
+
+	if (strncmp(arg, "other", len) == 0 && len == 5)
+		sched->policy = SCHED_OTHER;
+	else if (strncmp(arg, "fifo", len) == 0 && len == 4)
+		sched->policy = SCHED_FIFO;
+	else if (strncmp(arg, "rr", len) == 0 && len == 2)
+		sched->policy = SCHED_RR;
+	else
+		return false;
+
+	sched->priority = 0;
+	if (sched->policy == SCHED_OTHER)
+		return !prio;
+
+	/* compared before it's cast, so a huge one can't wrap into range */
+	if (!prio || !parse_size(prio + 1, &val) ||
+	    val < (size_t) sched_get_priority_min(sched->policy) ||
+	    val > (size_t) sched_get_priority_max(sched->policy))
+		return false;
+
+	sched->priority = val;
+	return true;
+}
+
+static bool parse_cpus(const char *arg, struct sta_sched *sched /* OUT */)
+{
+	char *end;
+	unsigned long first, last;
+
+	CPU_ZERO(&sched->cpus);
+
+	do {
+		errno = 0;
+		first = last = strtoul(arg, &end, 10);
+		if (*end == '-')
+			last = strtoul(end + 1, &end, 10);
+		if (errno || end == arg || first > last || last >= CPU_SETSIZE)
+			return false;
+
+		for (; first <= last; first++)
+			CPU_SET(first, &sched->cpus);
+
+		arg = end + 1;
+	} while (*end == ',');
+
+	sched->pinned = true;
+	return *end == '\0';
+}
+
+static const char * sched_name(int policy)
+{
+	switch (policy) {
+	case SCHED_FIFO:
+		return "SCHED_FIFO";
+	case SCHED_RR:
+		return "SCHED_RR";
+	default:
+		return "SCHED_OTHER";
+	}
+}
+
+/*
+ * With -R and --return, runs the return path one priority below the lowest
+ * of the SERIAL and ALSA threads, so it never preempts them. If either one
+ * isn't real-time, or has the lowest priority already, neither is the
+ * return path.
+ */
+static void rt_return_sched(void)
+{
+	const struct sta_sched *serial = &options.sched[T_SERIAL];
+	const struct sta_sched *alsa = &options.sched[T_ALSA];
+	int prio = (serial->priority < alsa->priority ?
+	            serial->priority : alsa->priority) - 1;
+
+	if (serial->policy == SCHED_OTHER || alsa->policy == SCHED_OTHER ||
+	    prio < sched_get_priority_min(SCHED_FIFO))
+		return;
+
+	options.sched[T_MIDI_IN].policy = SCHED_FIFO;
+	options.sched[T_MIDI_IN].priority = prio;
+	options.sched[T_SERIAL_OUT].policy = SCHED_FIFO;
+	options.sched[T_SERIAL_OUT].priority = prio;
+}
+
+/* Returns whether a thread of this kind is ever created. */
+static bool thread_used(int which)
+{
+	switch (which) {
+	case T_SERIAL:
+		/* the epoll workers too */
+		return true;
+	case T_ALSA:
+		return options.engine == ENGINE_THREADS;
+	default:
+		return options.engine == ENGINE_THREADS && options.ret;
+	}
+}
+
+/*
+ * Checks up front that we'll be allowed the real-time priorities we were
+ * asked for, instead of failing later at pthread_create() with EPERM.
+ */
+static int rt_check(void)
+{
+	struct rlimit rl;
+	size_t i;
+
+	if (getrlimit(RLIMIT_RTPRIO, &rl) < 0) {
+		eprint("REALTIME: cannot get RLIMIT_RTPRIO: %s", strerror(errno));
+		return -errno;
+	}
+
+	for (i = 0; i < T_COUNT; i++) {
+		const struct sta_sched *sched = &options.sched[i];
+
+		if (!thread_used(i) ||
+		    sched->policy == SCHED_OTHER || geteuid() == 0 ||
+		    rl.rlim_cur == RLIM_INFINITY ||
+		    (rlim_t) sched->priority <= rl.rlim_cur)
+			continue;
+
+		eprint("REALTIME: %s thread cannot get %s priority %d, "
+		       "RLIMIT_RTPRIO is %lu. Run as root or raise \"rtprio\" "
+		       "in /etc/security/limits.conf",
+		       thread_names[i], sched_name(sched->policy),
+		       sched->priority, (unsigned long) rl.rlim_cur);
+		return -EPERM;
+	}
+
+	return 0;
+}
+
+/* Keeps page faults out of the threads once they are running. */
+static int rt_lock_memory(void)
+{
+	if (mlockall(MCL_CURRENT | MCL_FUTURE) < 0) {
+		eprint("REALTIME: cannot lock memory: %s. Run as root or raise "
+		       "\"memlock\" in /etc/security/limits.conf",
+		       strerror(errno));
+		return -errno;
+	}
+
+	return 0;
+}
+
+static void rt_prefault_stack(void)
+{
+	volatile uint8_t stack[RT_STACK_PREFAULT];
+	size_t i;
+
+	for (i = 0; i < sizeof(stack); i += 4096)
+		stack[i] = 0;
+}
+
+static int thread_create(pthread_t *t, int which,
+                         void *(*worker)(void *), void *data)
+{
+	const struct sta_sched *sched = &options.sched[which];
+	struct sched_param param = { .sched_priority = sched->priority };
+	pthread_attr_t attr;
+	int err;
+
+	if ((err = pthread_attr_init(&attr)) != 0) {
+		eprint("THREAD: cannot create thread attribute object: %s",
+		       strerror(err));
+		return err;
+	}
+
+	if (options.realtime &&
+	    (err = pthread_attr_setstacksize(&attr, RT_STACK_SIZE)) != 0) {
+		eprint("THREAD: cannot set stack size of %s thread: %s",
+		       thread_names[which], strerror(err));
+		goto attr;
+	}
+
+	if (sched->policy != SCHED_OTHER &&
+	    ((err = pthread_attr_setinheritsched(&attr, PTHREAD_EXPLICIT_SCHED)) != 0 ||
+	     (err = pthread_attr_setschedpolicy(&attr, sched->policy)) != 0 ||
+	     (err = pthread_attr_setschedparam(&attr, &param)) != 0)) {
+		eprint("THREAD: cannot set scheduling of %s thread: %s",
+		       thread_names[which], strerror(err));
+		goto attr;
+	}
+
+	if (sched->pinned &&
+	    (err = pthread_attr_setaffinity_np(&attr, sizeof(sched->cpus),
+	                                       &sched->cpus)) != 0) {
+		eprint("THREAD: cannot set CPU affinity of %s thread: %s",
+		       thread_names[which], strerror(err));
+		goto attr;
+	}
+
+	if ((err = pthread_create(t, &attr, worker, data)) != 0) {
+		eprint("THREAD: cannot create %s thread: %s",
+		       thread_names[which], strerror(err));
+		if (err == EPERM) {
+			eprint("REALTIME: %s priority %d was not granted",
+			       sched_name(sched->policy), sched->priority);
+		}
+		goto attr;
+	}
+
+attr:
+	pthread_attr_destroy(&attr);
+	return err;
+}
+
+/* Reports the scheduling each thread actually ended up with. */
+static void thread_report(pthread_t t, int which)
+{
+	struct sched_param param;
+	cpu_set_t cpus;
+	int policy;
+
+	if (pthread_getschedparam(t, &policy, &param) != 0 ||
+	    pthread_getaffinity_np(t, sizeof(cpus), &cpus) != 0)
+		return;
+
+	printf("REALTIME: %s thread runs with %s priority %d on %d CPUs\n",
+	       thread_names[which], sched_name(policy),
+	       param.sched_priority, CPU_COUNT(&cpus));
+}
+
+/*
+ * How the lines we print tell an output from the others: by its MIDI port
+ * with several, and where it comes from too with --config. Empty if there's
+ * nothing to tell apart.
+ */
+static const char * output_label(struct sta_output *o, char *buf, size_t size)
+{
+	if (options.config) {
+		snprintf(buf, size, "%s -> %s", o->u->serial_port, o->port->name);
+	} else if (o->u->output_count > 1) {
+		snprintf(buf, size, "%s", o->port->name);
+	} else {
+		buf[0] = '\0';
+	}
+
+	return buf;
+}
+
+static void stats_print(struct sta_userdata *u)
+{
+	size_t i;
+
+	fprintf(stderr, "SERIAL: \"%s\": %s mode, %s framing, %s: %" PRIu64
+	        " frames (%" PRIu64 " malformed, %" PRIu64 " corrupt) in %"
+	        PRIu64 " reads\n", u->serial_port,
+	        serial_mode_names[options.serial_mode],
+	        framing_names[options.framing], crc_names[options.crc],
+	        stat_get(&u->stats.frames), stat_get(&u->stats.malformed),
+	        stat_get(&u->stats.corrupt), stat_get(&u->stats.reads));
+
+	fprintf(stderr, "SERIAL: \"%s\": overflow policy %s%s: %" PRIu64
+	        " blocked for %.1f ms, %" PRIu64 " dropped oldest, %" PRIu64
+	        " dropped newest, %" PRIu64 " coalesced\n", u->serial_port,
+	        overflow_names[options.overflow],
+	        options.rtscts ? " with RTS/CTS" : "",
+	        stat_get(&u->stats.blocked),
+	        stat_get(&u->stats.blocked_ns) / 1e6,
+	        stat_get(&u->stats.dropped_oldest),
+	        stat_get(&u->stats.dropped_newest),
+	        stat_get(&u->stats.coalesced));
+
+	for (i = 0; i < u->output_count; i++) {
+		struct sta_output *o = &u->outputs[i];
+
+		/* with --config, each line is the throughput of a route */
+		fprintf(stderr, "ALSA: %s \"%s\"",
+		        options.backend == BACKEND_SEQ ?
+		        backend_names[options.backend] : sink_names[o->port->sink],
+		        o->port->name);
+		if (options.config)
+			fprintf(stderr, " from \"%s\"", u->serial_port);
+
+		/*
+		 * From just before the first write to the end of the last, idle
+		 * time before doesn't count. A single write says nothing about
+		 * how fast they go.
+		 */
+		fprintf(stderr, ": %" PRIu64 " messages, %" PRIu64 " bytes in %"
+		        PRIu64 " writes",
+		        stat_get(&o->sent_frames),
+		        stat_get(&o->sent_bytes),
+		        stat_get(&o->writes));
+		if (stat_get(&o->writes) > 1 && o->last_write > o->first_write) {
+			fprintf(stderr, ", %.0f messages/s",
+			        stat_get(&o->sent_frames) * 1e9 /
+			        (o->last_write - o->first_write));
+		} else {
+			fprintf(stderr, ", n/a messages/s");
+		}
+		if (stat_get(&o->stalls)) {
+			/* the port may still not take more as we exit */
+			if (o->stalled)
+				stat_add(&o->stalled_ns, time_ns() - o->stalled);
+
+			fprintf(stderr, ", stalled %" PRIu64 " times for %.1f ms",
+			        stat_get(&o->stalls),
+			        stat_get(&o->stalled_ns) / 1e6);
+		}
+		if (options.backend == BACKEND_SEQ && options.seq_delay) {
+			fprintf(stderr, ", %" PRIu64 " later than %lu us",
+			        stat_get(&o->seq_late), options.seq_delay);
+		}
+		if (options.collapse) {
+			fprintf(stderr, ", %" PRIu64 " collapsed",
+			        stat_get(&o->collapsed));
+		}
+		if (u->output_count > 1) {
+			fprintf(stderr, ", %" PRIu64 " lagged behind",
+			        stat_get(&u->ring.cursors[o->cursor].lagged));
+		}
+		fputc('\n', stderr);
+	}
+
+	if (options.ret) {
+		fprintf(stderr, "RETURN: %" PRIu64 " messages, %" PRIu64
+		        " bytes in %" PRIu64 " writes, %" PRIu64 " dropped, %"
+		        PRIu64 " ALSA input overruns\n",
+		        stat_get(&u->stats.ret_frames),
+		        stat_get(&u->stats.ret_bytes),
+		        stat_get(&u->stats.ret_writes),
+		        stat_get(&u->stats.ret_dropped),
+		        stat_get(&u->stats.ret_xruns));
+	}
+}
+
+/* Prints a histogram's mean and percentiles, scaled down to unit. */
+static void hist_print(const char *name, struct sta_hist *h,
+                       const char *what, double scale, const char *unit)
+{
+	static const double pcts[] = { 50, 90, 99, 99.9 };
+	uint64_t counts[HIST_BUCKETS];
+	uint64_t total = 0, seen = 0;
+	size_t i, j;
+
+	/* the writing sides keep counting meanwhile, take a snapshot */
+	for (i = 0; i < HIST_BUCKETS; i++)
+		total += counts[i] = stat_get(&h->count[i]);
+
+	fprintf(stderr, "LATENCY: %-26s %" PRIu64 " %s", name, total, what);
+	if (!total) {
+		fputc('\n', stderr);
+		return;
+	}
+
+	fprintf(stderr, ", mean %.1f %s", stat_get(&h->sum) / scale / total,
+	        unit);
+	for (i = 0, j = 0; j < ARRAY_SIZE(pcts); j++) {
+		while (seen + counts[i] < total * pcts[j] / 100)
+			seen += counts[i++];
+		fprintf(stderr, ", p%g %.1f %s", pcts[j], hist_value(i) / scale,
+		        unit);
+	}
+	fprintf(stderr, ", max %.1f %s\n", stat_get(&h->max) / scale, unit);
+}
+
+/*
+ * Prints the latency percentiles of every stage in microseconds, and how
+ * much the rawmidi kernel buffer held on top of that.
+ */
+static void latency_print(struct sta_userdata *u)
+{
+	char label[256], name[320];
+	size_t i, l;
+
+	for (i = 0; i < u->output_count; i++) {
+		struct sta_output *o = &u->outputs[i];
+
+		/* with several outputs, each line says which one it is */
+		output_label(o, label, sizeof(label));
+		for (l = 0; l < L_RET_QUEUE; l++) {
+			snprintf(name, sizeof(name), "%s%s%s", label,
+			         label[0] ? " " : "", latency_names[l]);
+			hist_print(name, &o->latency[l], "frames", 1e3, "us");
+		}
+
+		if (o->port->rawmidi) {
+			snprintf(name, sizeof(name), "%s%skernel queue", label,
+			         label[0] ? " " : "");
+			hist_print(name, &o->kernel_queue, "samples", 1, "bytes");
+		}
+	}
+
+	if (!options.ret)
+		return;
+
+	for (l = L_RET_QUEUE; l < L_COUNT; l++)
+		hist_print(latency_names[l], &u->latency[l], "frames", 1e3, "us");
+}
+
+/*
+ * Applies the --alsa-* options to one half of the port and reports what
+ * the driver made of them. Returns the kernel buffer size or a negative
+ * error code.
+ */
+static ssize_t alsa_params(snd_rawmidi_t *r, const char *name,
+                           const char *half)
+{
+	snd_rawmidi_params_t *params;
+	int err;
+
+	snd_rawmidi_params_alloca(&params);
+
+	if ((err = snd_rawmidi_params_current(r, params)) < 0) {
+		eprint("ALSA: cannot get \"%s\" %s parameters: %s", name,
+		        half, snd_strerror(err));
+		return err;
+	}
+
+	if ((options.alsa_buffer &&
+	     (err = snd_rawmidi_params_set_buffer_size(r, params,
+	                                               options.alsa_buffer)) < 0) ||
+	    (options.alsa_avail_min &&
+	     (err = snd_rawmidi_params_set_avail_min(r, params,
+	                                             options.alsa_avail_min)) < 0) ||
+	    (options.no_active_sensing &&
+	     (err = snd_rawmidi_params_set_no_active_sensing(r, params, 1)) < 0) ||
+	    (err = snd_rawmidi_params(r, params)) < 0) {
+		eprint("ALSA: cannot set \"%s\" %s parameters: %s", name,
+		        half, snd_strerror(err));
+		return err;
+	}
+
+	/* the driver rounds the buffer to pages */
+	if ((err = snd_rawmidi_params_current(r, params)) < 0) {
+		eprint("ALSA: cannot get \"%s\" %s parameters: %s", name,
+		        half, snd_strerror(err));
+		return err;
+	}
+
+	printf("ALSA: \"%s\" %s buffer of %zu bytes, avail_min %zu\n", name, half,
+	       snd_rawmidi_params_get_buffer_size(params),
+	       snd_rawmidi_params_get_avail_min(params));
+
+	return snd_rawmidi_params_get_buffer_size(params);
+}
+
+/*
+ * Opens a port that is a sink other than rawmidi, non-blocking like one
+ * where that means anything, with a poll descriptor to wait for room on.
+ */
+static int sink_open(struct sta_port *p)
+{
+	struct sockaddr_un addr;
+	struct stat st;
+	int fd = -1, err;
+
+	switch (p->sink) {
+	case SINK_RAWMIDI:
+	case SINK_NULL:
+		break;
+	case SINK_FILE:
+		/* regular files never say no, and epoll won't have them */
+		fd = open(p->path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+		break;
+	case SINK_FIFO:
+		/*
+		 * Being a reader too, which Linux allows, spares us waiting for
+		 * one and EPIPE once it's gone: a FIFO nobody reads fills up and
+		 * stalls like a rawmidi port that doesn't keep up.
+		 */
+		if ((fd = open(p->path, O_RDWR | O_NONBLOCK | O_CLOEXEC)) < 0)
+			break;
+
+		if (fstat(fd, &st) < 0 || !S_ISFIFO(st.st_mode)) {
+			eprint("ALSA: \"%s\" is not a FIFO", p->path);
+			close(fd);
+			return -EINVAL;
+		}
+		break;
+	case SINK_SOCKET:
+		if (strlen(p->path) >= sizeof(addr.sun_path)) {
+			eprint("ALSA: socket path \"%s\" is too long", p->path);
+			return -ENAMETOOLONG;
+		}
+
+		memset(&addr, 0, sizeof(addr));
+		addr.sun_family = AF_UNIX;
+		strcpy(addr.sun_path, p->path);
+
+		if ((fd = socket(AF_UNIX, SOCK_DGRAM | SOCK_NONBLOCK | SOCK_CLOEXEC,
+		                 0)) < 0)
+			break;
+
+		if (connect(fd, (struct sockaddr *) &addr, sizeof(addr)) < 0) {
+			err = errno;
+			close(fd);
+			fd = -1;
+			errno = err;
+		}
+		break;
+	}
+
+	/* room for the stop eventfd as with rawmidi */
+	p->pfds = sta_malloc(2 * sizeof(*p->pfds));
+
+	if (p->sink == SINK_NULL)
+		return 0;
+
+	if (fd < 0) {
+		eprint("ALSA: cannot open %s sink \"%s\": %s",
+		        sink_names[p->sink], p->path, strerror(errno));
+		return -errno;
+	}
+	p->fd = fd;
+
+	if (p->sink != SINK_FILE) {
+		p->pfds[0].fd = fd;
+		p->pfds[0].events = POLLOUT;
+		p->pfds[0].revents = 0;
+		p->nfds = 1;
+	}
+
+	return 0;
+}
+
+/*
+ * Opens a rawmidi port, sizes its buffers and gets its poll descriptors.
+ * input is NULL unless the return path is on.
+ */
+static int alsa_setup(struct sta_port *p, snd_rawmidi_t **input /* OUT */)
+{
+	ssize_t err;
+
+	if (p->sink != SINK_RAWMIDI) {
+		if (input) {
+			eprint("ALSA: --return needs a rawmidi port, not \"%s\"",
+			        p->name);
+			return -EINVAL;
+		}
+
+		return sink_open(p);
+	}
+
+	if ((err = snd_rawmidi_open(input,
+	                            &p->rawmidi,
+	                            p->name,
+	                            SND_RAWMIDI_NONBLOCK)) < 0) {
+		eprint("ALSA: cannot open port \"%s\": %s",
+		        p->name, snd_strerror(err));
+		return err;
+	}
+
+	/*
+	 * The output stays non-blocking too: a consumer that doesn't keep up
+	 * leaves the rest of a batch queued instead of freezing us in a write.
+	 */
+	if (input && (err = alsa_params(*input, p->name, "input")) < 0)
+		return err;
+
+	if ((err = alsa_params(p->rawmidi, p->name, "output")) < 0)
+		return err;
+	p->buffer = err;
+
+	p->nfds = snd_rawmidi_poll_descriptors_count(p->rawmidi);
+	p->pfds = sta_malloc((p->nfds + 1) * sizeof(*p->pfds));
+	p->nfds = snd_rawmidi_poll_descriptors(p->rawmidi, p->pfds, p->nfds);
+
+	return 0;
+}
+
+/*
+ * Samples how much of what we wrote the kernel still holds, at most every
+ * STATUS_SAMPLE_NS: a write only means the bytes reached its buffer, and
+ * at 31250 baud a full one is a long way from the wire.
+ */
+static void alsa_status(struct sta_output *o, uint64_t now)
+{
+	struct sta_port *p = o->port;
+	snd_rawmidi_status_t *status;
+	size_t avail;
+	int err;
+
+	if (!p->buffer || now - o->status_at < STATUS_SAMPLE_NS)
+		return;
+	o->status_at = now;
+
+	snd_rawmidi_status_alloca(&status);
+
+	if ((err = snd_rawmidi_status(p->rawmidi, status)) < 0) {
+		eprint("ALSA: cannot get \"%s\" status, not sampling it any "
+		       "more: %s", p->name, snd_strerror(err));
+		p->buffer = 0;
+		return;
+	}
+
+	/* with --config, what the other routes to the port wrote too */
+	avail = snd_rawmidi_status_get_avail(status);
+	hist_add(&o->kernel_queue, avail < p->buffer ? p->buffer - avail : 0);
+}
+
+/*
+ * Sequencer backend: a client of our own with a port anybody can subscribe
+ * to, so no program has to open the rawmidi device itself. With a delay,
+ * every event is scheduled on a queue at the time its frame was read plus
+ * the delay, which takes the jitter of the bridge out as long as no frame
+ * is later than that.
+ */
+static int seq_setup(struct sta_userdata *u)
+{
+	int err;
+
+	if ((err = snd_seq_open(&u->seq, "default", SND_SEQ_OPEN_OUTPUT, 0)) < 0) {
+		eprint("ALSA: cannot open sequencer: %s", snd_strerror(err));
+		return err;
+	}
+
+	if ((err = snd_seq_set_client_name(u->seq, PACKAGE_NAME)) < 0) {
+		eprint("ALSA: cannot set sequencer client name: %s",
+		        snd_strerror(err));
+		return err;
+	}
+
+	if ((u->seq_port = snd_seq_create_simple_port(u->seq, "MIDI out",
+	                                              SND_SEQ_PORT_CAP_READ |
+	                                              SND_SEQ_PORT_CAP_SUBS_READ,
+	                                              SND_SEQ_PORT_TYPE_MIDI_GENERIC |
+	                                              SND_SEQ_PORT_TYPE_APPLICATION)) < 0) {
+		eprint("ALSA: cannot create sequencer port: %s",
+		        snd_strerror(u->seq_port));
+		return u->seq_port;
+	}
+
+	/* a frame is never longer, SysEx included */
+	if ((err = snd_midi_event_new(READ_SIZE, &u->seq_enc)) < 0) {
+		eprint("ALSA: cannot create MIDI event encoder: %s",
+		        snd_strerror(err));
+		return err;
+	}
+
+	if (options.seq_delay) {
+		if ((u->seq_queue = snd_seq_alloc_named_queue(u->seq,
+		                                              PACKAGE_NAME)) < 0) {
+			eprint("ALSA: cannot allocate sequencer queue: %s",
+			        snd_strerror(u->seq_queue));
+			return u->seq_queue;
+		}
+
+		if ((err = snd_seq_start_queue(u->seq, u->seq_queue, NULL)) < 0 ||
+		    (err = snd_seq_drain_output(u->seq)) < 0) {
+			eprint("ALSA: cannot start sequencer queue: %s",
+			        snd_strerror(err));
+			return err;
+		}
+	}
+
+	printf("ALSA: sequencer port %d:%d\n",
+	       snd_seq_client_id(u->seq), u->seq_port);
+
+	return 0;
+}
+
+/*
+ * Maps our clock to the queue's, again every SEQ_SYNC_NS: the queue runs
+ * off the system timer, which NTP may slew while CLOCK_MONOTONIC_RAW
+ * doesn't.
+ */
+static int seq_sync(struct sta_userdata *u, uint64_t now)
+{
+	snd_seq_queue_status_t *status;
+	const snd_seq_real_time_t *rt;
+	uint64_t before;
+	int err;
+
+	if (u->seq_sync && now - u->seq_sync < SEQ_SYNC_NS)
+		return 0;
+
+	snd_seq_queue_status_alloca(&status);
+
+	before = time_ns();
+	if ((err = snd_seq_get_queue_status(u->seq, u->seq_queue, status)) < 0) {
+		eprint("ALSA: cannot get sequencer queue status: %s",
+		        snd_strerror(err));
+		return err;
+	}
+	now = time_ns();
+
+	/* the queue was read somewhere in between */
+	rt = snd_seq_queue_status_get_real_time(status);
+	u->seq_base = before + (now - before) / 2 -
+	              (rt->tv_sec * 1000000000ull + rt->tv_nsec);
+	u->seq_sync = now;
+
+	return 0;
+}
+
+/* Turns the frames of a batch into events, with a single drain. */
+static int seq_write(struct sta_userdata *u, struct sta_output *o)
+{
+	const uint8_t *buf = o->batch;
+	snd_seq_real_time_t rt;
+	snd_seq_event_t ev;
+	uint64_t now, at;
+	size_t i, len;
+	long n;
+	int err;
+
+	now = time_ns();
+	if (options.seq_delay && (err = seq_sync(u, now)) < 0)
+		return err;
+
+	for (i = 0; i < o->batch_frames; buf += o->batch_lens[i++]) {
+		at = o->batch_stamps[i].read + options.seq_delay * 1000;
+		if (options.seq_delay && at < now)
+			stat_add(&o->seq_late, 1);
+
+		/* a late one is delivered right away */
+		at = at > u->seq_base ? at - u->seq_base : 0;
+		/*
+		 * seq_base moves a little on every seq_sync(), never let that
+		 * put an event ahead of one queued before it
+		 */
+		if (at < u->seq_last)
+			at = u->seq_last;
+		u->seq_last = at;
+		rt.tv_sec = at / 1000000000;
+		rt.tv_nsec = at % 1000000000;
+
+		/* the encoder keeps running status across frames */
+		for (len = 0; len < o->batch_lens[i]; len += n) {
+			snd_seq_ev_clear(&ev);
+
+			if ((n = snd_midi_event_encode(u->seq_enc, buf + len,
+			                               o->batch_lens[i] - len,
+			                               &ev)) <= 0)
+				break;
+
+			if (ev.type == SND_SEQ_EVENT_NONE)
+				continue;
+
+			snd_seq_ev_set_source(&ev, u->seq_port);
+			snd_seq_ev_set_subs(&ev);
+
+			if (options.seq_delay)
+				snd_seq_ev_schedule_real(&ev, u->seq_queue, 0, &rt);
+			else
+				snd_seq_ev_set_direct(&ev);
+
+			if ((err = snd_seq_event_output(u->seq, &ev)) < 0)
+				return err;
+		}
+	}
+
+	return (err = snd_seq_drain_output(u->seq)) < 0 ? err : 0;
+}
+
+/*
+ * Sends what is left of the batch to a socket sink, a datagram for each
+ * message so the reader gets them whole, but up to SINK_MSGS of them in a
+ * single call. Returns the bytes of the messages that went out or a
+ * negative error code.
+ */
+static ssize_t sink_send(struct sta_output *o)
+{
+	struct mmsghdr msgs[SINK_MSGS];
+	struct iovec iov[SINK_MSGS];
+	size_t i, off, n = 0;
+	ssize_t len = 0;
+	int sent, k;
+
+	/* messages never go out in part, so batch_off falls between two */
+	for (i = 0, off = 0; i < o->batch_frames && off < o->batch_off; i++)
+		off += o->batch_lens[i];
+
+	for (; i < o->batch_frames && n < SINK_MSGS; off += o->batch_lens[i++]) {
+		if (!o->batch_lens[i])
+			continue;
+
+		iov[n].iov_base = o->batch + off;
+		iov[n].iov_len = o->batch_lens[i];
+		memset(&msgs[n].msg_hdr, 0, sizeof(msgs[n].msg_hdr));
+		msgs[n].msg_hdr.msg_iov = &iov[n];
+		msgs[n].msg_hdr.msg_iovlen = 1;
+		n++;
+	}
+
+	/* only frames with nothing to send were left */
+	if (!n)
+		return o->batch_len - o->batch_off;
+
+	if ((sent = sendmmsg(o->port->fd, msgs, n, MSG_NOSIGNAL)) < 0)
+		return -errno;
+
+	for (k = 0; k < sent; k++)
+		len += iov[k].iov_len;
+
+	return len;
+}
+
+/*
+ * Sends what is left of the batch through the chosen backend and sink.
+ * Returns how many bytes went out, which may be fewer than asked or
+ * -EAGAIN with rawmidi, or a negative error code.
+ */
+static ssize_t alsa_write(struct sta_userdata *u, struct sta_output *o)
+{
+	struct sta_port *p = o->port;
+	size_t len = o->batch_len - o->batch_off;
+	ssize_t n;
+	int err;
+
+	switch (options.backend) {
+	case BACKEND_RAWMIDI:
+		break;
+	case BACKEND_SEQ:
+		/* the sequencer blocks, it takes a batch whole */
+		if ((err = seq_write(u, o)) < 0)
+			return err;
+		return len;
+	}
+
+	/* once a batch, there's no call through a pointer on the way to ALSA */
+	switch (p->sink) {
+	case SINK_RAWMIDI:
+		break;
+	case SINK_FILE:
+	case SINK_FIFO:
+		/* the batch is one run of bytes, a plain write takes it all */
+		n = write(p->fd, o->batch + o->batch_off, len);
+		return n < 0 ? -errno : n;
+	case SINK_SOCKET:
+		return sink_send(o);
+	case SINK_NULL:
+		return len;
+	}
+
+	return snd_rawmidi_write(p->rawmidi, o->batch + o->batch_off, len);
+}
+
+/* Which of POLLOUT, POLLERR and POLLHUP a port's poll descriptors say. */
+static int port_revents(struct sta_port *p, struct pollfd *pfds,
+                        unsigned short *revents /* OUT */)
+{
+	int i;
+
+	switch (p->sink) {
+	case SINK_RAWMIDI:
+		return snd_rawmidi_poll_descriptors_revents(p->rawmidi, pfds,
+		                                            p->nfds, revents);
+	case SINK_FILE:
+	case SINK_FIFO:
+	case SINK_SOCKET:
+	case SINK_NULL:
+		break;
+	}
+
+	for (*revents = 0, i = 0; i < p->nfds; i++)
+		*revents |= pfds[i].revents;
+
+	return 0;
+}
+
+/* Whether a rawmidi output still owes us room for part of a batch. */
+static bool alsa_pending(struct sta_output *o)
+{
+	return o->batch_off < o->batch_len;
+}
+
+/*
+ * Waits for a rawmidi output to have room again or to be asked to stop:
+ * only, or with the epoll engine any output that is pending. Returns -1 if
+ * a port is gone.
+ */
+static int alsa_wait_room(struct sta_userdata *u, struct sta_output *only)
+{
+	struct pollfd *pfds = only ? only->port->pfds : u->wait_pfds;
+	unsigned short revents;
+	struct sta_port *p;
+	size_t i;
+	int n, err;
+
+	if (only) {
+		n = only->port->nfds;
+	} else {
+		for (i = 0, n = 0; i < u->output_count; i++) {
+			p = u->outputs[i].port;
+			if (!alsa_pending(&u->outputs[i]))
+				continue;
+
+			memcpy(pfds + n, p->pfds, p->nfds * sizeof(*pfds));
+			n += p->nfds;
+		}
+	}
+
+	pfds[n].fd = u->stop_fd;
+	pfds[n].events = POLLIN;
+
+	if (poll(pfds, n + 1, -1) < 0) {
+		if (errno == EINTR)
+			return 0;
+
+		eprint("THREAD: cannot wait for ALSA port: %s",
+		        strerror(errno));
+		return -1;
+	}
+
+	if (pfds[n].revents)
+		return 0;
+
+	for (i = 0, n = 0; i < u->output_count; i++) {
+		struct sta_output *o = &u->outputs[i];
+
+		if (only ? o != only : !alsa_pending(o))
+			continue;
+
+		p = o->port;
+		if ((err = port_revents(p, pfds + n, &revents)) < 0) {
+			eprint("ALSA: cannot get poll events: %s",
+			        snd_strerror(err));
+			return -1;
+		}
+		n += p->nfds;
+
+		if (revents & (POLLERR | POLLHUP)) {
+			eprint("ALSA: port \"%s\" is gone", p->name);
+			return -1;
+		}
+	}
+
+	return 0;
+}
+
+/*
+ * Applies tio along with the baud rate, through termios2 and BOTHER so
+ * non-standard rates work too, and reports what the driver really applied.
+ * It's a single call: tio alone has no speed, and applied on its own would
+ * be B0, which hangs the line up.
+ */
+static int serial_set_attr(int fd, const char *port, const struct termios *tio,
+                           unsigned long baud)
+{
+	struct termios2 tio2;
+
+	if (ioctl(fd, TCGETS2, &tio2) < 0) {
+		eprint("SERIAL: cannot get attributes from \"%s\": %s",
+		        port, strerror(errno));
+		return -errno;
+	}
+
+	/* glibc's c_cc is longer, but its indexes are the kernel's */
+	tio2.c_iflag = tio->c_iflag;
+	tio2.c_oflag = tio->c_oflag;
+	tio2.c_lflag = tio->c_lflag;
+	memcpy(tio2.c_cc, tio->c_cc, sizeof(tio2.c_cc));
+
+	tio2.c_cflag = tio->c_cflag & ~(CBAUD | CBAUD << IBSHIFT);
+	tio2.c_cflag |= BOTHER | BOTHER << IBSHIFT;
+	tio2.c_ispeed = baud;
+	tio2.c_ospeed = baud;
+
+	/* like tcsetattr(TCSAFLUSH) */
+	if (ioctl(fd, TCSETSF2, &tio2) < 0) {
+		eprint("SERIAL: cannot set attributes for \"%s\": %s",
+		        port, strerror(errno));
+		return -errno;
+	}
+
+	/* the driver rounds the rate to what its clock can do */
+	if (ioctl(fd, TCGETS2, &tio2) < 0) {
+		eprint("SERIAL: cannot get attributes from \"%s\": %s",
+		        port, strerror(errno));
+		return -errno;
+	}
+
+	if (tio2.c_ospeed != baud || tio2.c_ispeed != baud) {
+		eprint("SERIAL: asked for %lu baud, \"%s\" runs at %u/%u "
+		       "(in/out)", baud, port, tio2.c_ispeed, tio2.c_ospeed);
+	} else {
+		printf("SERIAL: \"%s\" runs at %u baud\n", port, tio2.c_ospeed);
+	}
+
+	return 0;
+}
+
+/*
+ * Asks the driver to push received bytes to the tty right away instead of
+ * from a work queue, and to raise its RX interrupt after fewer bytes. Both
+ * are best effort: not every driver has them, so we only report.
+ */
+static void serial_low_latency(int fd, const char *port)
+{
+	struct serial_struct ss;
+	const char *tty, *name;
+	char path[PATH_MAX];
+	size_t bytes;
+	FILE *f;
+
+	if (ioctl(fd, TIOCGSERIAL, &ss) < 0) {
+		eprint("SERIAL: \"%s\" has no low latency mode: %s",
+		       port, strerror(errno));
+	} else {
+		ss.flags |= ASYNC_LOW_LATENCY;
+		if (ioctl(fd, TIOCSSERIAL, &ss) < 0 ||
+		    ioctl(fd, TIOCGSERIAL, &ss) < 0) {
+			eprint("SERIAL: cannot set low latency mode on \"%s\": "
+			       "%s", port, strerror(errno));
+		} else {
+			printf("SERIAL: low latency mode %s\n",
+			       ss.flags & ASYNC_LOW_LATENCY ? "on" : "refused");
+		}
+	}
+
+	if (!options.rx_trigger)
+		return;
+
+	/* the 8250 driver and a few others expose it in sysfs */
+	if (!(tty = ttyname(fd)))
+		tty = port;
+	name = strrchr(tty, '/') ? strrchr(tty, '/') + 1 : tty;
+	snprintf(path, sizeof(path), "/sys/class/tty/%s/rx_trig_bytes", name);
+
+	if (!(f = fopen(path, "w")) ||
+	    fprintf(f, "%zu\n", options.rx_trigger) < 0 || fclose(f) != 0) {
+		eprint("SERIAL: cannot set RX FIFO trigger of \"%s\": %s",
+		       port, strerror(errno));
+		return;
+	}
+
+	/* the driver rounds it to a level the FIFO supports */
+	if ((f = fopen(path, "r"))) {
+		if (fscanf(f, "%zu", &bytes) == 1)
+			printf("SERIAL: RX FIFO trigger at %zu bytes\n", bytes);
+		fclose(f);
+	}
+}
+
+static int serial_setup(const char *port)
+{
+	int fd, err;
+	struct termios tio;
+
+	if ((fd = open(port, O_RDONLY | O_NOCTTY)) < 0) {
+		eprint("SERIAL: cannot open port \"%s\": %s",
+		        port, strerror(errno));
+		err = fd;
+		goto err;
+	}
+
+	if ((err = tcgetattr(fd, &tio)) < 0) {
+		eprint("SERIAL: cannot get attributes from \"%s\": %s",
+		        port, strerror(errno));
+		goto err;
+	}
+
+	tio.c_cflag = CLOCAL | CREAD | CS8;
+	if (options.rtscts)
+		tio.c_cflag |= CRTSCTS;
+
+	if (options.serial_mode == SERIAL_RAW) {
+		/* every byte goes through untouched, frames are split later */
+		tio.c_iflag = IGNPAR | IGNBRK;
+		tio.c_oflag = 0;
+		tio.c_lflag = 0;
+		/*
+		 * read() waits for VMIN bytes, or for VTIME tenths of a second
+		 * without a new byte once the first one arrived. poll() only
+		 * reports VMIN bytes when VTIME is 0.
+		 */
+		tio.c_cc[VMIN]  = options.vmin;
+		tio.c_cc[VTIME] = options.vtime;
+	} else {
+		tio.c_iflag = IGNCR | IGNPAR | IGNBRK; /* ignore everything we can */
+		tio.c_oflag = 0; /* the return path is written untouched */
+		tio.c_lflag = ICANON; /* canonical mode */
+		/* use 0xFF as our end-of-line character */
+		tio.c_cc[VEOL]     = 0xFF;
+		tio.c_cc[VEOL2]    = 0xFF;
+		/* map everything else to a value we'll never see */
+		tio.c_cc[VEOF]     = 0xFE;
+		tio.c_cc[VERASE]   = 0xFE;
+		tio.c_cc[VKILL]    = 0xFE;
+		tio.c_cc[VLNEXT]   = 0xFE;
+		tio.c_cc[VREPRINT] = 0xFE;
+		tio.c_cc[VWERASE]  = 0xFE;
+	}
+
+	if ((err = serial_set_attr(fd, port, &tio, options.baud_rate)) < 0)
+		goto err;
+
+	if (options.low_latency)
+		serial_low_latency(fd, port);
+
+	fsync(fd);
+	tcflush(fd, TCIFLUSH);
+
+	return fd;
+
+err:
+	if (fd > 0)
+		close(fd);
+
+	return err;
+}
+
+static int wakeup_send(int fd)
+{
+	uint64_t one = 1;
+
+	if (write(fd, &one, sizeof(one)) < 0 && errno != EAGAIN) {
+		eprint("THREAD: cannot wake up the other thread: %s",
+		        strerror(errno));
+		return -errno;
+	}
+
+	return 0;
+}
+
+/* Asks every thread to finish. */
+static void sta_stop(struct sta_userdata *u)
+{
+	stop = true;
+	wakeup_send(u->stop_fd);
+}
+
+static void wakeup_reset(int fd)
+{
+	uint64_t val;
+
+	/* it's the ring that tells what to do, not the counter */
+	read(fd, &val, sizeof(val));
+}
+
+/*
+ * Sleeps until woken up through fd, asked to stop or timeout has passed
+ * (NULL: never). The caller must raise its *_wanted flag and re-check the
+ * ring before calling this.
+ */
+static int wakeup_wait(struct sta_userdata *u, int fd,
+                       const struct timespec *timeout)
+{
+	struct pollfd pfds[2] = {
+		{ .fd = fd, .events = POLLIN },
+		{ .fd = u->stop_fd, .events = POLLIN },
+	};
+
+	if (ppoll(pfds, ARRAY_SIZE(pfds), timeout, NULL) < 0 &&
+	    errno != EINTR) {
+		eprint("THREAD: cannot wait to be woken up: %s",
+		        strerror(errno));
+		return -errno;
+	}
+
+	if (pfds[0].revents & POLLIN)
+		wakeup_reset(fd);
+
+	return 0;
+}
+
+/* Wakes the other side up if it went to sleep waiting on wanted. */
+static int wakeup(atomic_bool *wanted, int fd)
+{
+	/* pairs with the fence after raising the flag */
+	atomic_thread_fence(memory_order_seq_cst);
+
+	if (!atomic_load_explicit(wanted, memory_order_relaxed))
+		return 0;
+
+	return wakeup_send(fd);
+}
+
+/* Wakes up the outputs that went to sleep waiting for frames. */
+static int alsa_wakeup(struct sta_userdata *u)
+{
+	size_t i;
+	int err;
+
+	for (i = 0; i < u->output_count; i++) {
+		struct sta_output *o = &u->outputs[i];
+
+		if ((err = wakeup(&o->data_wanted, o->data_fd)) < 0)
+			return err;
+	}
+
+	return 0;
+}
+
+/*
+ * With --collapse, copies the frame at the end of the batch over an older
+ * value for the same controller that is still in it. Returns false if there
+ * is none, then the frame stays and what it controls is remembered, or it
+ * holds the values of its channel, of all of them if it's a system message,
+ * where they are.
+ */
+static bool alsa_collapse(struct sta_output *o, size_t n, size_t frame)
+{
+	const uint8_t *buf = o->batch + n;
+	size_t len = o->batch_lens[frame], i, k;
+	struct sta_collapse *c;
+	uint32_t key;
+
+	/* real-time messages may go anywhere, empty frames don't go at all */
+	if (!len || buf[0] >= 0xF8)
+		return false;
+
+	if ((key = midi_coalesce_key(buf, len))) {
+		for (i = 0; i < o->collapse_count; i++) {
+			c = &o->collapse[i];
+			if (c->key != key)
+				continue;
+
+			/* same key, same status, same length */
+			memcpy(o->batch + c->off, buf, len);
+			o->batch_stamps[c->frame] = o->batch_stamps[frame];
+			stat_add(&o->collapsed, 1);
+			return true;
+		}
+
+		if (o->collapse_count < COLLAPSE_COUNT) {
+			c = &o->collapse[o->collapse_count++];
+			c->key = key;
+			c->frame = frame;
+			c->off = n;
+		}
+		return false;
+	}
+
+	/*
+	 * A key holds the status byte, and so the channel, in bits 8 to 11.
+	 * A frame longer than a message may hold anything. Channel mode
+	 * messages have no key and end up here too.
+	 */
+	for (i = 0, k = 0; i < o->collapse_count; i++) {
+		if (len <= 3 && buf[0] >= 0x80 && buf[0] < 0xF0 &&
+		    (o->collapse[i].key >> 8 & 0x0F) != (buf[0] & 0x0F))
+			o->collapse[k++] = o->collapse[i];
+	}
+	o->collapse_count = k;
+
+	return false;
+}
+
+/*
+ * Appends queued frames to the batch, up to --batch-size bytes (or frames,
+ * empty ones take no room but still need a stamp).
+ */
+static size_t alsa_gather(struct sta_userdata *u, struct sta_output *o,
+                          size_t n, size_t *frames)
+{
+	struct sta_stamp *stamp;
+	char label[256];
+	ssize_t len, j;
+	bool collapsed;
+
+	/* only what's in the batch and not sent yet can be replaced */
+	if (!*frames)
+		o->collapse_count = 0;
+
+	while (n < options.batch_size && *frames < options.batch_size &&
+	       (len = ring_pop(&u->ring, o->cursor, o->batch + n,
+	                       options.batch_size - n,
+	                       stamp = &o->batch_stamps[*frames])) >= 0) {
+		stamp->dequeued = time_ns();
+		o->batch_lens[*frames] = len;
+		hist_add(&o->latency[L_QUEUE], stamp->queued - stamp->read);
+		hist_add(&o->latency[L_WAIT], stamp->dequeued - stamp->queued);
+
+		/*
+		 * A single frame per batch while the port keeps up: there's
+		 * something to collapse only once frames pile up in the ring.
+		 */
+		collapsed = options.collapse && alsa_collapse(o, n, *frames);
+
+		if (!options.quiet) {
+			printf(COLOR_GREEN "MIDI --> ");
+			if (*output_label(o, label, sizeof(label)))
+				printf("%s: ", label);
+
+			/* the 0xFF at the end was not queued */
+			for (j = 0; j < len; j++)
+				printf("%02x ", o->batch[n + j]);
+
+			if (len == 0) {
+				printf("nothing to send");
+			}
+			if (collapsed)
+				printf("(collapsed)");
+
+			printf("\n" COLOR_RESET);
+			fflush(stdout);
+		}
+
+		if (collapsed)
+			continue;
+
+		n += len;
+		(*frames)++;
+	}
+
+	return n;
+}
+
+/*
+ * Keeps gathering frames into a batch that isn't full yet, for at most
+ * --batch-wait microseconds after its first frame was taken.
+ */
+static size_t alsa_linger(struct sta_userdata *u, struct sta_output *o,
+                          size_t n, size_t *frames)
+{
+	uint64_t deadline = time_ns() + options.batch_wait * 1000;
+
+	while (!stop && n < options.batch_size) {
+		uint64_t now = time_ns();
+		struct timespec ts;
+
+		if (now >= deadline)
+			break;
+
+		ts.tv_sec = (deadline - now) / 1000000000;
+		ts.tv_nsec = (deadline - now) % 1000000000;
+
+		atomic_store_explicit(&o->data_wanted, true, memory_order_relaxed);
+		atomic_thread_fence(memory_order_seq_cst);
+
+		if (ring_empty(&u->ring, o->cursor) &&
+		    wakeup_wait(u, o->data_fd, &ts) < 0)
+			sta_stop(u);
+
+		atomic_store_explicit(&o->data_wanted, false, memory_order_relaxed);
+
+		n = alsa_gather(u, o, n, frames);
+		if (wakeup(&u->room_wanted, u->room_fd) < 0)
+			sta_stop(u);
+
+		/* a frame that didn't fit has to wait for the next batch */
+		if (!ring_empty(&u->ring, o->cursor))
+			break;
+	}
+
+	return n;
+}
+
+/*
+ * Writes what is left of an output's batch. Returns false if the port didn't
+ * take all of it, true once the batch is done with, sent or lost to an error.
+ */
+static bool alsa_send(struct sta_userdata *u, struct sta_output *o)
+{
+	struct sta_port *p = o->port;
+	ssize_t len;
+	uint64_t now;
+	size_t i;
+
+	/* the first batch is counted too, so its write must be timed */
+	if (!o->first_write)
+		o->first_write = time_ns();
+
+	do {
+		/*
+		 * Outputs of several serial ports may share the port: the rest
+		 * of a batch it only took part of goes before anybody else's,
+		 * so their frames never end up interleaved.
+		 */
+		if (p->busy && p->busy != o && !alsa_send(p->busy->u, p->busy))
+			len = -EAGAIN;
+		else if ((len = alsa_write(u, o)) != -EAGAIN)
+			p->busy = len >= 0 && o->batch_off + len < o->batch_len ?
+			          o : NULL;
+
+		if (len == -EAGAIN) {
+			/* from the first time it didn't take more to the last */
+			if (!o->stalled) {
+				stat_add(&o->stalls, 1);
+				o->stalled = time_ns();
+				ring_stall(&u->ring, o->cursor, true);
+			}
+			return false;
+		}
+
+		if (len >= 0)
+			o->batch_off += len;
+
+		if (len > 0)
+			stat_add(&o->writes, 1);
+	} while (o->batch_off < o->batch_len && len >= 0);
+
+	now = time_ns();
+	if (o->stalled) {
+		stat_add(&o->stalled_ns, now - o->stalled);
+		o->stalled = 0;
+		ring_stall(&u->ring, o->cursor, false);
+	}
+
+	if (len < 0) {
+		eprint("ALSA: cannot send data to \"%s\": %s",
+		        p->name, snd_strerror(len));
+		o->batch_len = o->batch_off = 0;
+		return true;
+	}
+
+	for (i = 0; i < o->batch_frames; i++) {
+		struct sta_stamp *stamp = &o->batch_stamps[i];
+
+		hist_add(&o->latency[L_SEND], now - stamp->dequeued);
+		hist_add(&o->latency[L_TOTAL], now - stamp->read);
+	}
+
+	o->last_write = now;
+
+	stat_add(&o->sent_frames, o->batch_frames);
+	stat_add(&o->sent_bytes, o->batch_len);
+	o->batch_len = o->batch_off = 0;
+
+	if (p->rawmidi)
+		alsa_status(o, now);
+
+	return true;
+}
+
+/*
+ * Sends everything queued for an output so far, with one write per batch of
+ * frames. Returns false if the rawmidi port didn't take a whole batch: the
+ * rest is kept for when its poll descriptors say there's room again.
+ */
+static bool alsa_drain(struct sta_userdata *u, struct sta_output *o)
+{
+	/* the SERIAL side keeps filling the ring while we write */
+	while (!stop) {
+		if (o->batch_off == o->batch_len) {
+			size_t frames = 0, n;
+
+			if (!(n = alsa_gather(u, o, 0, &frames)) && !frames)
+				break;
+
+			/* the frames are ours now, their room can be reused */
+			if (wakeup(&u->room_wanted, u->room_fd) < 0)
+				sta_stop(u);
+
+			if (options.batch_wait && options.engine == ENGINE_THREADS)
+				n = alsa_linger(u, o, n, &frames);
+
+			if (n == 0)
+				continue;
+
+			o->batch_len = n;
+			o->batch_off = 0;
+			o->batch_frames = frames;
+		}
+
+		if (!alsa_send(u, o))
+			return false;
+	}
+
+	return true;
+}
+
+/* Epoll engine: drains every output. Returns false if one is pending. */
+static bool alsa_drain_all(struct sta_userdata *u)
+{
+	bool done = true;
+	size_t i;
+
+	for (i = 0; i < u->output_count; i++)
+		done &= alsa_drain(u, &u->outputs[i]);
+
+	return done;
+}
+
+/* Waits for the ALSA thread of each of the first count outputs. */
+static void alsa_join(struct sta_userdata *u, size_t count)
+{
+	size_t i;
+	int err;
+
+	for (i = 0; i < count; i++) {
+		if ((err = pthread_join(u->outputs[i].t, NULL)) != 0) {
+			eprint("THREAD: error while waiting for ALSA thread: %s",
+			        strerror(err));
+		}
+	}
+}
+
+static void * alsa_worker(void *data)
+{
+	struct sta_output *o = data;
+	struct sta_userdata *u;
+	char name[16];
+
+	assert(o);
+	u = o->u;
+
+	if (u->output_count > 1) {
+		snprintf(name, sizeof(name), "ALSA Thread %zu", o->cursor);
+		pthread_setname_np(pthread_self(), name);
+	} else {
+		pthread_setname_np(pthread_self(), "ALSA Thread");
+	}
+
+	if (options.realtime)
+		rt_prefault_stack();
+
+	while (!stop) {
+		atomic_store_explicit(&o->data_wanted, true, memory_order_relaxed);
+		atomic_thread_fence(memory_order_seq_cst);
+
+		/* a frame queued before the flag was raised is seen here */
+		while (!stop && ring_empty(&u->ring, o->cursor)) {
+			if (wakeup_wait(u, o->data_fd, NULL) < 0)
+				sta_stop(u);
+		}
+
+		atomic_store_explicit(&o->data_wanted, false, memory_order_relaxed);
+
+		while (!alsa_drain(u, o) && !stop) {
+			if (alsa_wait_room(u, o) < 0)
+				sta_stop(u);
+		}
+	}
+
+	return NULL;
+}
+
+/*
+ * Queues a frame for every output. If the ring is only full because of
+ * outputs whose port doesn't take more, their oldest frames are dropped:
+ * one port that doesn't keep up mustn't hold back the others. Returns false
+ * if it's full anyway, the overflow policy is up to the caller then.
+ */
+static bool serial_push(struct sta_userdata *u, const uint8_t *buf,
+                        size_t len, uint64_t read)
+{
+	while (!ring_push(&u->ring, buf, len, read)) {
+		if (!ring_lag(&u->ring))
+			return false;
+	}
+
+	return true;
+}
+
+/*
+ * Pushes a frame, waiting for the ALSA side to hand some room back if the
+ * ring is full. The tty isn't read meanwhile, so with --rtscts the kernel
+ * drops RTS once its own buffer is full. Returns false if we were asked to
+ * stop meanwhile.
+ */
+static bool serial_push_wait(struct sta_userdata *u,
+                             const uint8_t *buf, size_t len, uint64_t read)
+{
+	uint64_t blocked;
+	bool ok;
+
+	if (serial_push(u, buf, len, read))
+		return true;
+
+	stat_add(&u->stats.blocked, 1);
+	blocked = time_ns();
+
+	atomic_store_explicit(&u->room_wanted, true, memory_order_relaxed);
+	atomic_thread_fence(memory_order_seq_cst);
+
+	/*
+	 * A single read may fill the ring before serial_worker got to wake
+	 * the ALSA thread up, and then both sides would sleep.
+	 */
+	if (alsa_wakeup(u) < 0)
+		sta_stop(u);
+
+	while (!(ok = serial_push(u, buf, len, read)) && !stop) {
+		/* a single read can hold more frames than the ring */
+		if (options.engine == ENGINE_EPOLL) {
+			/*
+			 * Once the outputs that keep up took what they could,
+			 * ring_lag() may leave the stalled ones behind: only
+			 * wait for those if it can't.
+			 */
+			if (!alsa_drain_all(u) &&
+			    !(ok = serial_push(u, buf, len, read)) &&
+			    alsa_wait_room(u, NULL) < 0)
+				sta_stop(u);
+			if (ok)
+				break;
+			continue;
+		}
+
+		if (wakeup_wait(u, u->room_fd, NULL) < 0)
+			break;
+	}
+
+	atomic_store_explicit(&u->room_wanted, false, memory_order_relaxed);
+
+	stat_add(&u->stats.blocked_ns, time_ns() - blocked);
+
+	return ok;
+}
+
+/* Moves pending controller values to the ring, as many as fit. */
+static size_t serial_flush_pending(struct sta_userdata *u)
+{
+	size_t i;
+
+	for (i = 0; i < u->pending_count; i++) {
+		if (!serial_push(u, u->pending[i].msg, u->pending[i].len,
+		               u->pending[i].read))
+			break;
+	}
+
+	u->pending_count -= i;
+	memmove(u->pending, u->pending + i,
+	        u->pending_count * sizeof(*u->pending));
+
+	return i;
+}
+
+/* Keeps a controller value aside, replacing an older one for the same key. */
+static bool serial_coalesce(struct sta_userdata *u, uint32_t key,
+                            const uint8_t *buf, size_t len, uint64_t read)
+{
+	struct sta_pending *p;
+	size_t i;
+
+	for (i = 0; i < u->pending_count; i++) {
+		p = &u->pending[i];
+		if (p->key == key) {
+			memcpy(p->msg, buf, len);
+			p->read = read;
+			stat_add(&u->stats.coalesced, 1);
+			return true;
+		}
+	}
+
+	if (u->pending_count == PENDING_COUNT)
+		return false;
+
+	p = &u->pending[u->pending_count++];
+	p->key = key;
+	p->len = len;
+	p->read = read;
+	memcpy(p->msg, buf, len);
+	return true;
+}
+
+/*
+ * Queues a frame read at the given time applying the overflow policy. Returns
+ * 0 if it went straight into the ring, 1 if the ring overflowed, or -1 if
+ * asked to stop meanwhile.
+ */
+static int serial_enqueue(struct sta_userdata *u, const uint8_t *buf,
+                          size_t len, uint64_t read)
+{
+	uint32_t key;
+	size_t i;
+
+	if (!u->pending_count && serial_push(u, buf, len, read))
+		return 0;
+
+	/*
+	 * The epoll engine only drains the ring after a whole read, which
+	 * may hold more than it does: the outputs that keep up get a chance
+	 * to take their frames before any is dropped or held back.
+	 */
+	if (options.engine == ENGINE_EPOLL && !u->pending_count) {
+		alsa_drain_all(u);
+		if (serial_push(u, buf, len, read))
+			return 0;
+	}
+
+	switch (options.overflow) {
+	case OVERFLOW_BLOCK:
+		return serial_push_wait(u, buf, len, read) ? 1 : -1;
+
+	case OVERFLOW_DROP_OLDEST:
+		while (!serial_push(u, buf, len, read)) {
+			if (!ring_drop(&u->ring)) {
+				/* all that's left is being sent right now */
+				stat_add(&u->stats.dropped_newest, 1);
+				break;
+			}
+			stat_add(&u->stats.dropped_oldest, 1);
+		}
+		return 1;
+
+	case OVERFLOW_DROP_NEWEST:
+		stat_add(&u->stats.dropped_newest, 1);
+		return 1;
+
+	case OVERFLOW_COALESCE:
+		serial_flush_pending(u);
+		if (!u->pending_count && serial_push(u, buf, len, read))
+			return 0;
+
+		key = midi_coalesce_key(buf, len);
+		if (key && serial_coalesce(u, key, buf, len, read))
+			return 1;
+
+		/*
+		 * Anything else, a channel mode message such as Reset All
+		 * Controllers included, must not overtake the pending values,
+		 * nor have a newer one coalesced ahead of it.
+		 */
+		for (i = 0; i < u->pending_count; i++) {
+			if (!serial_push_wait(u, u->pending[i].msg,
+			                      u->pending[i].len,
+			                      u->pending[i].read))
+				return -1;
+		}
+		u->pending_count = 0;
+
+		return serial_push_wait(u, buf, len, read) ? 1 : -1;
+	}
+
+	return 1;
+}
+
+/*
+ * Frame delimiter scanners: each one writes the offset of every delim byte
+ * in buf to eol, in a single pass, and returns how many there are. buf is at
+ * most 64 KiB so an offset fits in 16 bits.
+ */
+static size_t scan_eol_from(const uint8_t *buf, size_t i, size_t len,
+                            uint8_t delim, uint16_t *eol)
+{
+	size_t n = 0;
+
+	for (; i < len; i++) {
+		if (buf[i] == delim)
+			eol[n++] = i;
+	}
+
+	return n;
+}
+
+static size_t scan_eol_scalar(const uint8_t *buf, size_t len, uint8_t delim,
+                              uint16_t *eol)
+{
+	return scan_eol_from(buf, 0, len, delim, eol);
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+__attribute__((target("sse2")))
+static size_t scan_eol_sse2(const uint8_t *buf, size_t len, uint8_t delim,
+                            uint16_t *eol)
+{
+	const __m128i d = _mm_set1_epi8(delim);
+	size_t i, n = 0;
+
+	for (i = 0; i + 16 <= len; i += 16) {
+		__m128i v = _mm_loadu_si128((const __m128i *) (buf + i));
+		unsigned m = _mm_movemask_epi8(_mm_cmpeq_epi8(v, d));
+
+		for (; m; m &= m - 1)
+			eol[n++] = i + __builtin_ctz(m);
+	}
+
+	return n + scan_eol_from(buf, i, len, delim, eol + n);
+}
+
+__attribute__((target("avx2")))
+static size_t scan_eol_avx2(const uint8_t *buf, size_t len, uint8_t delim,
+                            uint16_t *eol)
+{
+	const __m256i d = _mm256_set1_epi8(delim);
+	size_t i, n = 0;
+
+	for (i = 0; i + 32 <= len; i += 32) {
+		__m256i v = _mm256_loadu_si256((const __m256i *) (buf + i));
+		unsigned m = _mm256_movemask_epi8(_mm256_cmpeq_epi8(v, d));
+
+		for (; m; m &= m - 1)
+			eol[n++] = i + __builtin_ctz(m);
+	}
+
+	return n + scan_eol_from(buf, i, len, delim, eol + n);
+}
+#elif defined(__ARM_NEON)
+static size_t scan_eol_neon(const uint8_t *buf, size_t len, uint8_t delim,
+                            uint16_t *eol)
+{
+	size_t i, n = 0;
+
+	for (i = 0; i + 16 <= len; i += 16) {
+		uint8x16_t eq = vceqq_u8(vld1q_u8(buf + i), vdupq_n_u8(delim));
+		/* there's no movemask, narrow each byte to 4 bits instead */
+		uint64_t m = vget_lane_u64(vreinterpret_u64_u8(
+			vshrn_n_u16(vreinterpretq_u16_u8(eq), 4)), 0);
+
+		for (m &= 0x8888888888888888ull; m; m &= m - 1)
+			eol[n++] = i + __builtin_ctzll(m) / 4;
+	}
+
+	return n + scan_eol_from(buf, i, len, delim, eol + n);
+}
+#endif
+
+static size_t (*scan_eol)(const uint8_t *, size_t, uint8_t, uint16_t *) =
+	scan_eol_scalar;
+
+/* Picks the widest scanner the CPU we run on has. */
+static void scan_eol_init(void)
+{
+#if defined(__x86_64__) || defined(__i386__)
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("avx2"))
+		scan_eol = scan_eol_avx2;
+	else if (__builtin_cpu_supports("sse2"))
+		scan_eol = scan_eol_sse2;
+#elif defined(__ARM_NEON)
+	scan_eol = scan_eol_neon;
+#endif
+}
+
+/*
+ * Frame decoders: each one decodes a frame, without its delimiter or length,
+ * in place and returns its new length, or -1 if it's malformed.
+ */
+static ssize_t sentinel_decode(uint8_t *buf, size_t len)
+{
+	size_t i;
+
+	/* STM32 internal protocol */
+	for (i = 0; i < len; i++) {
+		if (buf[i] == 0xFA)
+			buf[i] = 0x0A;
+	}
+
+	return len;
+}
+
+static ssize_t cobs_decode(uint8_t *buf, size_t len)
+{
+	size_t i = 0, n = 0;
+
+	while (i < len) {
+		size_t code = buf[i++];
+
+		if (code == 0 || i + code - 1 > len)
+			return -1;
+
+		/* a block is never written ahead of where it's read from */
+		memmove(buf + n, buf + i, code - 1);
+		n += code - 1;
+		i += code - 1;
+
+		/* every block but a full one and the last stood for a zero */
+		if (code != 0xFF && i < len)
+			buf[n++] = 0x00;
+	}
+
+	return n;
+}
+
+static ssize_t slip_decode(uint8_t *buf, size_t len)
+{
+	size_t i, n = 0;
+
+	for (i = 0; i < len; i++) {
+		if (buf[i] != SLIP_ESC) {
+			buf[n++] = buf[i];
+			continue;
+		}
+
+		if (++i == len)
+			return -1;
+
+		switch (buf[i]) {
+		case SLIP_ESC_END:
+			buf[n++] = SLIP_END;
+			break;
+		case SLIP_ESC_ESC:
+			buf[n++] = SLIP_ESC;
+			break;
+		default:
+			return -1;
+		}
+	}
+
+	return n;
+}
+
+/*
+ * Byte-at-a-time tables: 768 bytes that stay in the L1 cache, a few cycles
+ * a byte even on a Cortex-A9, which has no carry-less multiply for wider
+ * kernels to use.
+ */
+static uint8_t crc8_table[256];
+static uint16_t crc16_table[256];
+
+static void crc_init(void)
+{
+	unsigned i, j;
+
+	for (i = 0; i < 256; i++) {
+		uint8_t c8 = i;
+		uint16_t c16 = i << 8;
+
+		for (j = 0; j < 8; j++) {
+			c8 = c8 & 0x80 ? c8 << 1 ^ 0x07 : c8 << 1;
+			c16 = c16 & 0x8000 ? c16 << 1 ^ 0x1021 : c16 << 1;
+		}
+
+		crc8_table[i] = c8;
+		crc16_table[i] = c16;
+	}
+}
+
+static uint8_t crc8(const uint8_t *buf, size_t len)
+{
+	uint8_t crc = 0x00;
+
+	while (len--)
+		crc = crc8_table[crc ^ *buf++];
+
+	return crc;
+}
+
+static uint16_t crc16(const uint8_t *buf, size_t len)
+{
+	uint16_t crc = 0xFFFF;
+
+	while (len--)
+		crc = crc << 8 ^ crc16_table[(crc >> 8) ^ *buf++];
+
+	return crc;
+}
+
+/* Checks and strips the CRC trailer of a decoded frame. */
+static bool crc_check(const uint8_t *buf, size_t *len)
+{
+	size_t n = crc_sizes[options.crc];
+
+	if (*len < n)
+		return false;
+
+	*len -= n;
+
+	switch (options.crc) {
+	case CRC_NONE:
+		break;
+	case CRC_8:
+		return crc8(buf, *len) == buf[*len];
+	case CRC_16:
+		return crc16(buf, *len) == (buf[*len] << 8 | buf[*len + 1]);
+	}
+
+	return true;
+}
+
+/* Appends the CRC trailer to a frame, buf must have room for it. */
+static size_t crc_append(uint8_t *buf, size_t len)
+{
+	uint16_t crc;
+
+	switch (options.crc) {
+	case CRC_NONE:
+		break;
+	case CRC_8:
+		buf[len] = crc8(buf, len);
+		break;
+	case CRC_16:
+		crc = crc16(buf, len);
+		buf[len] = crc >> 8;
+		buf[len + 1] = crc;
+		break;
+	}
+
+	return len + crc_sizes[options.crc];
+}
+
+static ssize_t frame_decode(uint8_t *buf, size_t len)
+{
+	switch (options.framing) {
+	case FRAMING_SENTINEL:
+		return sentinel_decode(buf, len);
+	case FRAMING_COBS:
+		return cobs_decode(buf, len);
+	case FRAMING_SLIP:
+		return slip_decode(buf, len);
+	case FRAMING_LENGTH:
+		break;
+	}
+
+	return len;
+}
+
+/*
+ * Frame encoders, the other way round for the return path: each one encodes
+ * a frame into out, delimiter or length included, and returns its new
+ * length, or -1 if the framing can't carry it. out must have room for
+ * 2 * len + 2 bytes.
+ */
+static ssize_t sentinel_encode(const uint8_t *buf, size_t len, uint8_t *out)
+{
+	size_t i;
+
+	for (i = 0; i < len; i++) {
+		/* System Reset and Start would read as our own bytes */
+		if (buf[i] == 0xFF || buf[i] == 0xFA)
+			return -1;
+
+		out[i] = buf[i] == 0x0A ? 0xFA : buf[i];
+	}
+
+	out[len] = 0xFF;
+
+	return len + 1;
+}
+
+static ssize_t cobs_encode(const uint8_t *buf, size_t len, uint8_t *out)
+{
+	/* out[code] is where the length of the current block goes */
+	size_t i, code = 0, n = 1;
+
+	for (i = 0; i < len; i++) {
+		if (buf[i] == 0x00) {
+			out[code] = n - code;
+			code = n++;
+			continue;
+		}
+
+		out[n++] = buf[i];
+
+		if (n - code == 0xFF) {
+			out[code] = 0xFF;
+			code = n++;
+		}
+	}
+
+	out[code] = n - code;
+	out[n++] = 0x00;
+
+	return n;
+}
+
+static ssize_t slip_encode(const uint8_t *buf, size_t len, uint8_t *out)
+{
+	size_t i, n = 0;
+
+	/* flushes whatever line noise came before */
+	out[n++] = SLIP_END;
+
+	for (i = 0; i < len; i++) {
+		switch (buf[i]) {
+		case SLIP_END:
+			out[n++] = SLIP_ESC;
+			out[n++] = SLIP_ESC_END;
+			break;
+		case SLIP_ESC:
+			out[n++] = SLIP_ESC;
+			out[n++] = SLIP_ESC_ESC;
+			break;
+		default:
+			out[n++] = buf[i];
+		}
+	}
+
+	out[n++] = SLIP_END;
+
+	return n;
+}
+
+static ssize_t frame_encode(const uint8_t *buf, size_t len, uint8_t *out)
+{
+	switch (options.framing) {
+	case FRAMING_SENTINEL:
+		return sentinel_encode(buf, len, out);
+	case FRAMING_COBS:
+		return cobs_encode(buf, len, out);
+	case FRAMING_SLIP:
+		return slip_encode(buf, len, out);
+	case FRAMING_LENGTH:
+		break;
+	}
+
+	out[0] = len >> 8;
+	out[1] = len;
+	memcpy(out + 2, buf, len);
+
+	return len + 2;
+}
+
+/*
+ * Decodes and queues a frame read at the given time. Returns 0 if it was
+ * queued, dropped by the overflow policy or malformed, -1 if we were asked
+ * to stop.
+ */
+static int serial_frame(struct sta_userdata *u, uint8_t *buf, size_t len,
+                        uint64_t now)
+{
+	ssize_t decoded;
+	size_t i;
+
+	stat_add(&u->stats.frames, 1);
+
+	if ((decoded = frame_decode(buf, len)) < 0) {
+		stat_add(&u->stats.malformed, 1);
+		return 0;
+	}
+	len = decoded;
+
+	if (options.crc && !crc_check(buf, &len)) {
+		stat_add(&u->stats.corrupt, 1);
+		return 0;
+	}
+
+	if (!options.quiet) {
+		printf(COLOR_YELLOW "MIDI <-- ");
+		if (options.config)
+			printf("%s: ", u->serial_port);
+		for (i = 0; i < len; i++)
+			printf("%02x ", buf[i]);
+		printf("\n" COLOR_RESET);
+		fflush(stdout);
+	}
+
+	switch (serial_enqueue(u, buf, len, now)) {
+	case 0:
+		/* report the next overflow once the ALSA side caught up */
+		if (u->overflowing && ring_used(&u->ring) < u->ring.size / 2)
+			u->overflowing = false;
+		return 0;
+	case 1:
+		if (!u->overflowing) {
+			eprint("SERIAL: Buffer overflow... %s",
+			       overflow_names[options.overflow]);
+			fflush(stderr);
+			u->overflowing = true;
+		}
+		return 0;
+	default:
+		return -1;
+	}
+}
+
+/*
+ * Reads what the serial port has and queues the frames in it. Returns 1 if
+ * something was queued, 0 if not, -1 if we were asked to stop or -2 if the
+ * port is gone.
+ */
+static int serial_read(struct sta_userdata *u)
+{
+	size_t start = 0, end, i, n;
+	ssize_t len;
+	uint64_t now;
+	int queued = 0;
+
+	if ((len = read(u->fd, u->rx + u->rx_len,
+	                sizeof(u->rx) - u->rx_len)) <= 0) {
+		eprint("SERIAL: cannot read from \"%s\": %s",
+		        u->serial_port,
+		        len == 0 ? "hung up" : strerror(errno));
+		return -2;
+	}
+	now = time_ns();
+	stat_add(&u->stats.reads, 1);
+	end = u->rx_len + len;
+
+	if (options.serial_mode == SERIAL_CANONICAL) {
+		/* drop the 0xFF end-of-line character */
+		if (u->rx[end - 1] == 0xFF)
+			end--;
+
+		return serial_frame(u, u->rx, end, now) < 0 ? -1 : 1;
+	}
+
+	if (options.framing == FRAMING_LENGTH) {
+		while (end - start >= 2) {
+			size_t flen = u->rx[start] << 8 | u->rx[start + 1];
+
+			/* it would never fit, and where the next one is is lost */
+			if (flen > sizeof(u->rx) - 2) {
+				stat_add(&u->stats.malformed, 1);
+				start = end;
+				break;
+			}
+
+			if (end - start < 2 + flen)
+				break;
+
+			if (serial_frame(u, u->rx + start + 2, flen, now) < 0)
+				return -1;
+
+			start += 2 + flen;
+			queued = 1;
+		}
+
+		goto carry;
+	}
+
+	/* only the bytes we just read can hold a new delimiter */
+	n = scan_eol(u->rx + u->rx_len, len, framing_delim[options.framing],
+	             u->eol);
+	for (i = 0; i < n; i++) {
+		size_t pos = u->rx_len + u->eol[i];
+
+		/* COBS and SLIP senders may repeat delimiters to resync */
+		if (pos > start || options.framing == FRAMING_SENTINEL) {
+			if (serial_frame(u, u->rx + start, pos - start, now) < 0)
+				return -1;
+
+			queued = 1;
+		}
+
+		start = pos + 1;
+	}
+
+	if (start == 0 && end == sizeof(u->rx)) {
+		/* n_tty would also give up on a line this long */
+		if (options.framing == FRAMING_SENTINEL) {
+			if (serial_frame(u, u->rx, end, now) < 0)
+				return -1;
+
+			queued = 1;
+		} else {
+			stat_add(&u->stats.malformed, 1);
+		}
+
+		start = end;
+	}
+
+carry:
+	u->rx_len = end - start;
+	memmove(u->rx, u->rx + start, u->rx_len);
+
+	return queued;
+}
+
+/*
+ * Closes a serial port that went away and starts watching for its node to
+ * show up again with inotify. The queue and the ALSA side are left alone
+ * meanwhile. Returns -1 if it can't be watched for.
+ */
+static int serial_lost(struct sta_userdata *u)
+{
+	close(u->fd);
+	u->fd = -1;
+	/* whatever was left of a frame won't get its end */
+	u->rx_len = 0;
+	u->lost = time_ns();
+	u->wd = -1;
+
+	if ((u->inotify_fd = inotify_init1(IN_CLOEXEC | IN_NONBLOCK)) < 0) {
+		eprint("SERIAL: cannot watch for \"%s\": %s",
+		        u->serial_port, strerror(errno));
+		return -1;
+	}
+
+	eprint("SERIAL: waiting for \"%s\" to come back", u->serial_port);
+
+	return 0;
+}
+
+/*
+ * Looks for a lost serial port again, once inotify_fd is readable or, while
+ * its directory can't be watched, every second. Sets it up like it was if
+ * it's back. Returns true if it is.
+ */
+static bool serial_retry(struct sta_userdata *u)
+{
+	const char *port = u->serial_port;
+	char dir[PATH_MAX], *slash;
+	char events[4096]
+		__attribute__((aligned(__alignof__(struct inotify_event))));
+	ssize_t len, i;
+
+	while ((len = read(u->inotify_fd, events, sizeof(events))) > 0) {
+		for (i = 0; i < len; ) {
+			struct inotify_event *ev = (void *) (events + i);
+
+			if (ev->mask & IN_IGNORED)
+				u->wd = -1;
+			i += sizeof(*ev) + ev->len;
+		}
+	}
+
+	/* udev may also create the directory, like /dev/serial/by-id */
+	if (u->wd < 0) {
+		snprintf(dir, sizeof(dir), "%s", port);
+		if (!(slash = strrchr(dir, '/')))
+			snprintf(dir, sizeof(dir), ".");
+		else if (slash == dir)
+			slash[1] = '\0';
+		else
+			*slash = '\0';
+
+		u->wd = inotify_add_watch(u->inotify_fd, dir, IN_CREATE |
+		                          IN_MOVED_TO | IN_ATTRIB);
+	}
+
+	/* it may already be back, before the watch was in place */
+	if (access(port, F_OK) != 0 || (u->fd = serial_setup(port)) < 0)
+		return false;
+
+	close(u->inotify_fd);
+	u->inotify_fd = -1;
+
+	printf("SERIAL: \"%s\" is back after %.3f s\n", port,
+	       (time_ns() - u->lost) / 1e9);
+	fflush(stdout);
+
+	return true;
+}
+
+/*
+ * Threads engine: waits for a serial port that went away to come back.
+ * Returns 0 once it is or -1 if we were asked to stop.
+ */
+static int serial_reconnect(struct sta_userdata *u)
+{
+	struct pollfd pfds[2];
+
+	if (serial_lost(u) < 0)
+		return -1;
+
+	pfds[0].fd = u->inotify_fd;
+	pfds[0].events = POLLIN;
+	pfds[1].fd = u->stop_fd;
+	pfds[1].events = POLLIN;
+
+	while (!stop && !serial_retry(u)) {
+		/* without a watch, look again every second */
+		if (poll(pfds, ARRAY_SIZE(pfds), u->wd < 0 ? RETRY_MS : -1) < 0) {
+			if (errno == EINTR)
+				continue;
+
+			eprint("SERIAL: cannot wait for \"%s\": %s",
+			        u->serial_port, strerror(errno));
+			break;
+		}
+
+		if (pfds[1].revents)
+			break;
+	}
+
+	if (u->fd < 0) {
+		close(u->inotify_fd);
+		u->inotify_fd = -1;
+		return -1;
+	}
+
+	return 0;
+}
+
+static void * serial_worker(void *data)
+{
+	struct sta_userdata *u = data;
+	struct pollfd pfds[3];
+
+	assert(u);
+
+	pthread_setname_np(pthread_self(), "SERIAL Thread");
+
+	if (options.realtime)
+		rt_prefault_stack();
+
+	pfds[0].fd = u->fd;
+	pfds[0].events = POLLIN;
+	pfds[1].fd = u->stop_fd;
+	pfds[1].events = POLLIN;
+	/* only watched while coalesced values are pending */
+	pfds[2].fd = u->room_fd;
+	pfds[2].events = POLLIN;
+
+	while (!stop) {
+		int err;
+
+		if (u->pending_count) {
+			atomic_store_explicit(&u->room_wanted, true,
+			                      memory_order_relaxed);
+			atomic_thread_fence(memory_order_seq_cst);
+
+			/* the ALSA thread may have caught up by now */
+			if (serial_flush_pending(u) && alsa_wakeup(u) < 0)
+				break;
+		}
+
+		/* no timeout: SIGINT comes through stop_fd */
+		err = poll(pfds, u->pending_count ? 3 : 2, -1);
+
+		atomic_store_explicit(&u->room_wanted, false,
+		                      memory_order_relaxed);
+
+		if (err < 0) {
+			if (errno == EINTR)
+				continue;
+
+			eprint("THREAD: cannot wait for terminal in SERIAL "
+			        "thread: %s", strerror(errno));
+			break;
+		}
+
+		if (pfds[2].revents & POLLIN)
+			wakeup_reset(u->room_fd);
+
+		if (pfds[1].revents)
+			break;
+
+		if (!pfds[0].revents)
+			continue;
+
+		if ((err = serial_read(u)) == -2 && options.reconnect) {
+			if (serial_reconnect(u) < 0)
+				break;
+
+			pfds[0].fd = u->fd;
+			continue;
+		}
+
+		if (err < 0)
+			break;
+
+		if (err > 0 && alsa_wakeup(u) < 0)
+			break;
+	}
+
+	/* let the ALSA thread notice we are done */
+	sta_stop(u);
+
+	return NULL;
+}
+
+/*
+ * Opens the serial port a second time for the return path, so the SERIAL
+ * side can close and reconnect its own fd without us. It never blocks: a
+ * full TX FIFO must not keep us from noticing we were asked to stop.
+ */
+static bool serial_out_open(struct sta_userdata *u)
+{
+	if (u->out_fd >= 0)
+		return true;
+
+	if ((u->out_fd = open(u->serial_port,
+	                      O_WRONLY | O_NOCTTY | O_NONBLOCK)) < 0) {
+		/* once, not for every message while the port is away */
+		if (!u->tx_lost) {
+			eprint("SERIAL: cannot open port \"%s\" for the return "
+			       "path: %s", u->serial_port,
+			       strerror(errno));
+		}
+		u->tx_lost = true;
+		return false;
+	}
+
+	u->tx_lost = false;
+	return true;
+}
+
+/* Throws away the return path frames that weren't written yet. */
+static void serial_tx_drop(struct sta_userdata *u)
+{
+	stat_add(&u->stats.ret_dropped, u->tx_frames);
+	u->tx_len = 0;
+	u->tx_off = 0;
+	u->tx_frames = 0;
+}
+
+/* Encodes queued return path frames into tx, as many as surely fit. */
+static void serial_gather(struct sta_userdata *u)
+{
+	struct sta_stamp *stamp;
+	ssize_t len, n, j;
+
+	while (TX_SIZE - u->tx_len >= TX_FRAME_MAX &&
+	       (len = ring_pop(&u->ret, 0, u->ret_msg, READ_SIZE,
+	                       stamp = &u->tx_stamps[u->tx_frames])) >= 0) {
+		stamp->dequeued = time_ns();
+		hist_add(&u->latency[L_RET_QUEUE], stamp->queued - stamp->read);
+		hist_add(&u->latency[L_RET_WAIT], stamp->dequeued - stamp->queued);
+
+		if (!options.quiet) {
+			printf(COLOR_GREEN "SERIAL --> ");
+			for (j = 0; j < len; j++)
+				printf("%02x ", u->ret_msg[j]);
+			printf("\n" COLOR_RESET);
+			fflush(stdout);
+		}
+
+		len = crc_append(u->ret_msg, len);
+		if ((n = frame_encode(u->ret_msg, len, u->tx + u->tx_len)) < 0) {
+			stat_add(&u->stats.ret_dropped, 1);
+			continue;
+		}
+
+		u->tx_len += n;
+		u->tx_frames++;
+	}
+}
+
+/*
+ * Writes the queued return path frames to the serial port. Returns false if
+ * the port didn't take all of them yet, then out_fd has to become writable.
+ */
+static bool serial_send(struct sta_userdata *u)
+{
+	ssize_t len;
+	uint64_t now;
+	size_t i;
+
+	while (!stop) {
+		if (u->tx_off == u->tx_len) {
+			serial_gather(u);
+
+			/* the frames are ours now, their room can be reused */
+			if (wakeup(&u->ret_room_wanted, u->ret_room_fd) < 0)
+				sta_stop(u);
+
+			if (!u->tx_len)
+				break;
+		}
+
+		if (!serial_out_open(u)) {
+			serial_tx_drop(u);
+			break;
+		}
+
+		while (u->tx_off < u->tx_len) {
+			len = write(u->out_fd, u->tx + u->tx_off,
+			            u->tx_len - u->tx_off);
+			if (len < 0 && errno == EINTR)
+				continue;
+
+			if (len < 0 && errno == EAGAIN)
+				return false;
+
+			if (len < 0) {
+				eprint("SERIAL: cannot write to \"%s\": %s",
+				        u->serial_port,
+				        strerror(errno));
+				close(u->out_fd);
+				u->out_fd = -1;
+				serial_tx_drop(u);
+				/* opened again with the next frames */
+				return true;
+			}
+
+			u->tx_off += len;
+			stat_add(&u->stats.ret_writes, 1);
+		}
+
+		now = time_ns();
+		for (i = 0; i < u->tx_frames; i++) {
+			struct sta_stamp *stamp = &u->tx_stamps[i];
+
+			hist_add(&u->latency[L_RET_SEND], now - stamp->dequeued);
+			hist_add(&u->latency[L_RET_TOTAL], now - stamp->read);
+		}
+
+		stat_add(&u->stats.ret_frames, u->tx_frames);
+		stat_add(&u->stats.ret_bytes, u->tx_len);
+		u->tx_len = 0;
+		u->tx_off = 0;
+		u->tx_frames = 0;
+	}
+
+	return true;
+}
+
+static void * serial_out_worker(void *data)
+{
+	struct sta_userdata *u = data;
+	struct pollfd pfds[2];
+
+	assert(u);
+
+	pthread_setname_np(pthread_self(), "SER OUT Thread");
+
+	if (options.realtime)
+		rt_prefault_stack();
+
+	pfds[1].fd = u->stop_fd;
+	pfds[1].events = POLLIN;
+
+	while (!stop) {
+		atomic_store_explicit(&u->ret_data_wanted, true,
+		                      memory_order_relaxed);
+		atomic_thread_fence(memory_order_seq_cst);
+
+		while (!stop && ring_empty(&u->ret, 0)) {
+			if (wakeup_wait(u, u->ret_data_fd, NULL) < 0)
+				sta_stop(u);
+		}
+
+		atomic_store_explicit(&u->ret_data_wanted, false,
+		                      memory_order_relaxed);
+
+		while (!stop && !serial_send(u)) {
+			pfds[0].fd = u->out_fd;
+			pfds[0].events = POLLOUT;
+
+			if (poll(pfds, ARRAY_SIZE(pfds), -1) < 0 &&
+			    errno != EINTR) {
+				eprint("THREAD: cannot wait for terminal in "
+				       "SERIAL OUT thread: %s", strerror(errno));
+				sta_stop(u);
+			}
+		}
+	}
+
+	return NULL;
+}
+
+/*
+ * Queues a message of the ALSA input for the serial port. With the threads
+ * engine it waits for the SERIAL OUT thread to hand some room back, the
+ * ALSA input buffer holds what comes meanwhile. The epoll engine must not
+ * wait, it writes to the serial port in place and drops the message if
+ * there's still no room. Returns false if we were asked to stop meanwhile.
+ */
+static bool midi_in_push(struct sta_userdata *u,
+                         const uint8_t *msg, size_t len, uint64_t read)
+{
+	bool ok;
+
+	if (ring_push(&u->ret, msg, len, read))
+		return true;
+
+	if (options.engine == ENGINE_EPOLL) {
+		serial_send(u);
+
+		if (!ring_push(&u->ret, msg, len, read))
+			stat_add(&u->stats.ret_dropped, 1);
+
+		return true;
+	}
+
+	atomic_store_explicit(&u->ret_room_wanted, true, memory_order_relaxed);
+	atomic_thread_fence(memory_order_seq_cst);
+
+	if (wakeup(&u->ret_data_wanted, u->ret_data_fd) < 0)
+		sta_stop(u);
+
+	while (!(ok = ring_push(&u->ret, msg, len, read)) && !stop) {
+		if (wakeup_wait(u, u->ret_room_fd, NULL) < 0)
+			break;
+	}
+
+	atomic_store_explicit(&u->ret_room_wanted, false, memory_order_relaxed);
+
+	return ok;
+}
+
+/*
+ * Reads what the ALSA input has and queues the messages in it. Returns 1 if
+ * something was queued, 0 if not or -1 if the port is gone or we were asked
+ * to stop.
+ */
+static int midi_in_read(struct sta_userdata *u)
+{
+	uint8_t buf[READ_SIZE];
+	snd_rawmidi_status_t *status;
+	const uint8_t *msg;
+	ssize_t len, i;
+	size_t n;
+	uint64_t now;
+	int queued = 0;
+
+	if ((len = snd_rawmidi_read(u->input, buf, sizeof(buf))) < 0) {
+		if (len == -EAGAIN)
+			return 0;
+
+		eprint("ALSA: cannot read from \"%s\": %s",
+		        u->outputs[0].port->name, snd_strerror(len));
+		return -1;
+	}
+	now = time_ns();
+
+	/* what the input buffer lost since, reading it starts counting again */
+	snd_rawmidi_status_alloca(&status);
+	if (snd_rawmidi_status(u->input, status) == 0)
+		stat_add(&u->stats.ret_xruns, snd_rawmidi_status_get_xruns(status));
+
+	for (i = 0; i < len; i++) {
+		if (!(n = midi_parse(&u->midi, buf[i], &msg)))
+			continue;
+
+		if (!midi_in_push(u, msg, n, now))
+			return -1;
+
+		queued = 1;
+	}
+
+	return queued;
+}
+
+static void * midi_in_worker(void *data)
+{
+	struct sta_userdata *u = data;
+	unsigned short revents;
+	struct pollfd *pfds;
+	int n, err;
+
+	assert(u);
+
+	pthread_setname_np(pthread_self(), "MIDI IN Thread");
+
+	if (options.realtime)
+		rt_prefault_stack();
+
+	n = snd_rawmidi_poll_descriptors_count(u->input);
+	pfds = sta_malloc((n + 1) * sizeof(*pfds));
+	n = snd_rawmidi_poll_descriptors(u->input, pfds, n);
+	pfds[n].fd = u->stop_fd;
+	pfds[n].events = POLLIN;
+
+	while (!stop) {
+		if (poll(pfds, n + 1, -1) < 0) {
+			if (errno == EINTR)
+				continue;
+
+			eprint("THREAD: cannot wait for ALSA input in MIDI IN "
+			        "thread: %s", strerror(errno));
+			break;
+		}
+
+		if (pfds[n].revents)
+			break;
+
+		if ((err = snd_rawmidi_poll_descriptors_revents(u->input, pfds,
+		                                                n, &revents)) < 0) {
+			eprint("ALSA: cannot get poll events: %s",
+			        snd_strerror(err));
+			break;
+		}
+
+		if (revents & (POLLERR | POLLHUP)) {
+			eprint("ALSA: port \"%s\" is gone",
+			        u->outputs[0].port->name);
+			break;
+		}
+
+		if (!(revents & POLLIN))
+			continue;
+
+		if ((err = midi_in_read(u)) < 0)
+			break;
+
+		if (err > 0 && wakeup(&u->ret_data_wanted, u->ret_data_fd) < 0)
+			break;
+	}
+
+	free(pfds);
+
+	/* the output half of the port is gone too */
+	sta_stop(u);
+
+	return NULL;
+}
+
+/* The serial port whose fd, or inotify_fd while it's away, fd is. */
+static struct sta_userdata * epoll_bridge(struct sta_worker *w, int fd)
+{
+	size_t k;
+
+	for (k = 0; k < w->count; k++) {
+		if (w->bridges[k]->fd == fd || w->bridges[k]->inotify_fd == fd)
+			return w->bridges[k];
+	}
+
+	return NULL;
+}
+
+/* The MIDI port a poll descriptor is of, NULL if it's only the input's. */
+static struct sta_port * epoll_port(struct sta_worker *w, int fd)
+{
+	size_t k;
+	int j;
+
+	for (k = 0; k < w->port_count; k++) {
+		struct sta_port *p = w->ports[k];
+
+		for (j = 0; j < p->nfds; j++) {
+			if (p->pfds[j].fd == fd)
+				return p;
+		}
+	}
+
+	return NULL;
+}
+
+/*
+ * Drains every output of a serial port. Coalesced controller values have
+ * no thread of their own to wait for room, so they go to the ring as soon
+ * as there is some, and out after it.
+ */
+static void epoll_drain(struct sta_userdata *b)
+{
+	alsa_drain_all(b);
+
+	while (b->pending_count && serial_flush_pending(b))
+		alsa_drain_all(b);
+}
+
+/* Drains every output on a MIDI port that has room again. */
+static void epoll_drain_port(struct sta_worker *w, struct sta_port *p)
+{
+	size_t k, i;
+
+	for (k = 0; k < w->count; k++) {
+		struct sta_userdata *b = w->bridges[k];
+
+		for (i = 0; i < b->output_count; i++) {
+			if (b->outputs[i].port == p)
+				alsa_drain(b, &b->outputs[i]);
+		}
+
+		if (b->pending_count)
+			epoll_drain(b);
+	}
+}
+
+/*
+ * Watches a lost serial port's fd again if it's back, or its inotify_fd
+ * otherwise. The thread goes on with the others meanwhile. Returns -1 if
+ * it can't.
+ */
+static int epoll_retry(int epfd, struct sta_userdata *b)
+{
+	struct epoll_event ev;
+	bool back;
+
+	/* the inotify fd left the set when it was closed */
+	back = serial_retry(b);
+
+	ev.events = EPOLLIN;
+	ev.data.fd = back ? b->fd : b->inotify_fd;
+	if (epoll_ctl(epfd, EPOLL_CTL_ADD, ev.data.fd, &ev) < 0 &&
+	    errno != EEXIST) {
+		eprint("EPOLL: cannot watch serial port: %s", strerror(errno));
+		return -1;
+	}
+
+	return 0;
+}
+
+/*
+ * Epoll engine: the serial ports and the rawmidi descriptors share one
+ * epoll set, and each frame is written out by the same thread right after
+ * it was read, so there's no wake-up nor context switch in between. With
+ * --config, every thread does that for some of the serial ports.
+ *
+ * The ring is drained after every read, so it never gets full here and the
+ * overflow policy never has to wait for another thread. A port that doesn't
+ * take more can still fill it, and then the block policy holds back the
+ * other serial ports of the thread too. A rawmidi port is only watched for
+ * room while it owes some output room. The return path is
+ * just more event sources: the ALSA input, and the serial port's out_fd
+ * while it owes us room.
+ */
+static void * epoll_worker(void *data)
+{
+	struct sta_worker *w = data;
+	struct sta_userdata *u, *b;
+	struct epoll_event ev, events[8];
+	struct pollfd *pfds = NULL, *in_pfds = NULL;
+	struct sta_port *p;
+	bool out_watched = false, lost;
+	uint64_t now, retry = 0;
+	int epfd, err, fd, i, j, n, nfds = 0, timeout;
+	size_t k, l;
+	char name[16];
+
+	assert(w);
+
+	/* the return path only comes with a single serial port */
+	u = w->bridges[0];
+
+	if (options.workers > 1) {
+		snprintf(name, sizeof(name), "EPOLL Thread %zu", w->index);
+		pthread_setname_np(pthread_self(), name);
+	} else {
+		pthread_setname_np(pthread_self(), "EPOLL Thread");
+	}
+
+	if (options.realtime)
+		rt_prefault_stack();
+
+	if ((epfd = epoll_create1(EPOLL_CLOEXEC)) < 0) {
+		eprint("EPOLL: cannot create epoll instance: %s",
+		        strerror(errno));
+		goto end;
+	}
+
+	for (k = 0; k < w->count; k++) {
+		ev.events = EPOLLIN;
+		ev.data.fd = w->bridges[k]->fd;
+		if (epoll_ctl(epfd, EPOLL_CTL_ADD, ev.data.fd, &ev) < 0) {
+			eprint("EPOLL: cannot watch serial port: %s",
+			        strerror(errno));
+			goto epoll;
+		}
+	}
+
+	ev.events = EPOLLIN;
+	ev.data.fd = u->stop_fd;
+	if (epoll_ctl(epfd, EPOLL_CTL_ADD, u->stop_fd, &ev) < 0) {
+		eprint("EPOLL: cannot watch stop event: %s", strerror(errno));
+		goto epoll;
+	}
+
+	if (u->input &&
+	    (n = snd_rawmidi_poll_descriptors_count(u->input)) > 0) {
+		in_pfds = sta_malloc(n * sizeof(*in_pfds));
+		n = snd_rawmidi_poll_descriptors(u->input, in_pfds, n);
+
+		for (i = 0; i < n; i++) {
+			ev.events = EPOLLIN;
+			ev.data.fd = in_pfds[i].fd;
+			if (epoll_ctl(epfd, EPOLL_CTL_ADD, in_pfds[i].fd, &ev) < 0) {
+				eprint("EPOLL: cannot watch ALSA input: %s",
+				        strerror(errno));
+				goto epoll;
+			}
+		}
+	}
+
+	/* only errors are reported until something can't be written */
+	for (k = 0; k < w->port_count; k++)
+		nfds += w->ports[k]->nfds;
+
+	if (nfds > 0)
+		pfds = sta_malloc(nfds * sizeof(*pfds));
+
+	for (k = 0, n = 0; k < w->port_count; n += p->nfds, k++) {
+		p = w->ports[k];
+		if (p->nfds > 0)
+			memcpy(pfds + n, p->pfds, p->nfds * sizeof(*pfds));
+	}
+
+	for (i = 0; i < nfds; i++) {
+		ev.events = 0;
+		ev.data.fd = pfds[i].fd;
+		/*
+		 * Both halves of a hw port share an fd, already watched for
+		 * input. events keeps what it's watched for besides room.
+		 */
+		pfds[i].events = 0;
+		if (epoll_ctl(epfd, EPOLL_CTL_ADD, pfds[i].fd, &ev) < 0) {
+			if (errno != EEXIST) {
+				eprint("EPOLL: cannot watch ALSA port: %s",
+				        strerror(errno));
+				goto epoll;
+			}
+			pfds[i].events = EPOLLIN;
+		}
+	}
+
+	while (!stop) {
+		/*
+		 * A lost serial port without an inotify watch is looked for
+		 * on a deadline: the other ports may keep epoll_wait() from
+		 * ever timing out.
+		 */
+		now = time_ns();
+		for (k = 0, lost = false; k < w->count; k++) {
+			b = w->bridges[k];
+			if (b->fd >= 0 || b->wd >= 0)
+				continue;
+
+			if (now >= retry && epoll_retry(epfd, b) < 0)
+				sta_stop(u);
+			if (b->fd < 0 && b->wd < 0)
+				lost = true;
+		}
+
+		if (lost && now >= retry)
+			retry = now + RETRY_MS * 1000000ull;
+		timeout = lost ? (int) ((retry - now + 999999) / 1000000) : -1;
+
+		if ((n = epoll_wait(epfd, events, ARRAY_SIZE(events),
+		                    timeout)) < 0) {
+			if (errno == EINTR)
+				continue;
+
+			eprint("EPOLL: cannot wait for events: %s",
+			        strerror(errno));
+			break;
+		}
+
+		for (i = 0; i < n && !stop; i++) {
+			fd = events[i].data.fd;
+
+			if (fd == u->stop_fd)
+				break;
+
+			if (fd == u->out_fd) {
+				serial_send(u);
+				continue;
+			}
+
+			if ((b = epoll_bridge(w, fd))) {
+				if (fd == b->inotify_fd) {
+					if (epoll_retry(epfd, b) < 0)
+						sta_stop(u);
+					continue;
+				}
+
+				if ((err = serial_read(b)) == -2 &&
+				    options.reconnect) {
+					/* closing it took it off the epoll set */
+					if (serial_lost(b) < 0 ||
+					    epoll_retry(epfd, b) < 0)
+						sta_stop(u);
+					continue;
+				}
+
+				if (err < 0) {
+					sta_stop(u);
+					break;
+				}
+
+				epoll_drain(b);
+				continue;
+			}
+
+			p = epoll_port(w, fd);
+
+			if (events[i].events & (EPOLLERR | EPOLLHUP)) {
+				eprint("ALSA: port \"%s\" is gone",
+				        p ? p->name : u->outputs[0].port->name);
+				sta_stop(u);
+				break;
+			}
+
+			if (p && (events[i].events & EPOLLOUT))
+				epoll_drain_port(w, p);
+
+			if (!(events[i].events & EPOLLIN))
+				continue;
+
+			if (midi_in_read(u) < 0) {
+				sta_stop(u);
+				break;
+			}
+
+			serial_send(u);
+		}
+
+		/*
+		 * A closed out_fd already left the set, and then the frames
+		 * it owed were dropped so it isn't watched any more either.
+		 */
+		if ((u->tx_off < u->tx_len) != out_watched) {
+			out_watched = !out_watched;
+			ev.events = EPOLLOUT;
+			ev.data.fd = u->out_fd;
+			epoll_ctl(epfd, out_watched ? EPOLL_CTL_ADD : EPOLL_CTL_DEL,
+			          u->out_fd, &ev);
+		}
+
+		/* a port shared by several outputs owes room to any of them */
+		for (k = 0; k < w->port_count; k++)
+			w->ports[k]->pending = false;
+
+		for (k = 0; k < w->count; k++) {
+			b = w->bridges[k];
+			for (l = 0; l < b->output_count; l++) {
+				if (alsa_pending(&b->outputs[l]))
+					b->outputs[l].port->pending = true;
+			}
+		}
+
+		for (k = 0, n = 0; k < w->port_count; n += p->nfds, k++) {
+			p = w->ports[k];
+			if (p->pending == p->watched)
+				continue;
+
+			p->watched = !p->watched;
+
+			for (j = n; j < n + p->nfds; j++) {
+				ev.events = pfds[j].events |
+				            (p->watched ? EPOLLOUT : 0);
+				ev.data.fd = pfds[j].fd;
+				if (epoll_ctl(epfd, EPOLL_CTL_MOD, pfds[j].fd, &ev) < 0) {
+					eprint("EPOLL: cannot watch ALSA port: %s",
+					        strerror(errno));
+					sta_stop(u);
+				}
+			}
+		}
+	}
+
+epoll:
+	free(in_pfds);
+	free(pfds);
+	close(epfd);
+
+end:
+	sta_stop(u);
+	return NULL;
+}
+
+/* Waits for every epoll thread of the first count. */
+static void epoll_join(struct sta_worker *workers, size_t count)
+{
+	size_t i;
+	int err;
+
+	for (i = 0; i < count; i++) {
+		if ((err = pthread_join(workers[i].t, NULL)) != 0) {
+			eprint("THREAD: error while waiting for EPOLL thread: %s",
+			        strerror(err));
+		}
+	}
+}
+
+/* The group a serial port ended up in, see epoll_plan(). */
+static size_t group_find(size_t *group, size_t i)
+{
+	while (group[i] != i)
+		i = group[i] = group[group[i]];
+
+	return i;
+}
+
+/*
+ * Spreads the serial ports over at most --workers epoll threads. Those
+ * routed to the same MIDI port, even through another one, make a group
+ * that a single thread serves; each group goes to the thread serving the
+ * fewest serial ports so far. Returns how many threads that takes.
+ */
+static size_t epoll_plan(struct sta_userdata *bridges, size_t count,
+                         struct sta_port *ports, size_t port_count,
+                         struct sta_worker *workers)
+{
+	size_t *group = sta_malloc(count * sizeof(*group));
+	size_t *size = sta_malloc(count * sizeof(*size));
+	size_t *owner = sta_malloc(count * sizeof(*owner));
+	size_t *first = sta_malloc(port_count * sizeof(*first));
+	size_t *load = sta_malloc(options.workers * sizeof(*load));
+	size_t i, j, k, r, used = 0;
+
+	for (i = 0; i < count; i++) {
+		group[i] = i;
+		size[i] = 0;
+		owner[i] = SIZE_MAX;
+	}
+
+	for (k = 0; k < port_count; k++)
+		first[k] = SIZE_MAX;
+
+	for (i = 0; i < count; i++) {
+		for (j = 0; j < bridges[i].output_count; j++) {
+			k = bridges[i].outputs[j].port - ports;
+			if (first[k] == SIZE_MAX)
+				first[k] = i;
+			else
+				group[group_find(group, i)] = group_find(group, first[k]);
+		}
+	}
+
+	for (i = 0; i < count; i++)
+		size[group_find(group, i)]++;
+
+	for (i = 0; i < count; i++) {
+		r = group_find(group, i);
+
+		if (owner[r] == SIZE_MAX && used < options.workers) {
+			k = used++;
+			workers[k].index = k;
+			workers[k].bridges = sta_malloc(count *
+			                                sizeof(*workers[k].bridges));
+			workers[k].count = 0;
+			workers[k].ports = sta_malloc(port_count *
+			                              sizeof(*workers[k].ports));
+			workers[k].port_count = 0;
+			load[k] = size[r];
+			owner[r] = k;
+		} else if (owner[r] == SIZE_MAX) {
+			for (j = 1, k = 0; j < used; j++) {
+				if (load[j] < load[k])
+					k = j;
+			}
+			load[k] += size[r];
+			owner[r] = k;
+		}
+
+		k = owner[r];
+		workers[k].bridges[workers[k].count++] = &bridges[i];
+	}
+
+	/* and every thread gets the MIDI ports of its serial ports */
+	for (k = 0; k < used; k++) {
+		struct sta_worker *w = &workers[k];
+
+		for (i = 0; i < w->count; i++) {
+			for (j = 0; j < w->bridges[i]->output_count; j++) {
+				struct sta_port *p = w->bridges[i]->outputs[j].port;
+
+				for (r = 0; r < w->port_count; r++) {
+					if (w->ports[r] == p)
+						break;
+				}
+				if (r == w->port_count)
+					w->ports[w->port_count++] = p;
+			}
+		}
+	}
+
+	free(group);
+	free(size);
+	free(owner);
+	free(first);
+	free(load);
+
+	return used;
+}
+
+/*
+ * Waits for SIGINT/SIGTERM or for a worker to give up, whichever is first,
+ * printing the latency histograms of the count serial ports of u on SIGUSR1
+ * meanwhile.
+ */
+static void signal_wait(struct sta_userdata *u, size_t count, int sfd)
+{
+	struct pollfd pfds[2] = {
+		{ .fd = sfd, .events = POLLIN },
+		{ .fd = u->stop_fd, .events = POLLIN },
+	};
+	struct signalfd_siginfo si;
+	size_t i;
+
+	while (!stop) {
+		if (poll(pfds, ARRAY_SIZE(pfds), -1) < 0) {
+			if (errno == EINTR)
+				continue;
+
+			eprint("cannot wait for signals: %s", strerror(errno));
+			sta_stop(u);
+			break;
+		}
+
+		if ((pfds[0].revents & POLLIN) &&
+		    read(sfd, &si, sizeof(si)) == sizeof(si)) {
+			switch (si.ssi_signo) {
+			case SIGINT:
+			case SIGTERM:
+				sta_stop(u);
+				break;
+			case SIGUSR1:
+				for (i = 0; i < count; i++)
+					latency_print(&u[i]);
+				break;
+			}
+		}
+	}
+}
+
+static void config_free(struct sta_route *routes, size_t count)
+{
+	size_t i, j;
+
+	for (i = 0; i < count; i++) {
+		free(routes[i].serial_port);
+		for (j = 0; j < routes[i].midi_port_count; j++)
+			free(routes[i].midi_ports[j]);
+	}
+	free(routes);
+}
+
+/*
+ * Reads --config: a serial port per line followed by the MIDI ports its
+ * frames go to, # starts a comment. Returns how many serial ports there
+ * are, or -1.
+ */
+static int config_load(const char *path, struct sta_route **routes /* OUT */)
+{
+	static const char delims[] = " \t\r\n";
+	struct sta_route *r = NULL, *route;
+	size_t count = 0, line = 0, len = 0, i;
+	char *buf = NULL, *tok, *save, *hash;
+	FILE *f;
+
+	if (!(f = fopen(path, "r"))) {
+		eprint("CONFIG: cannot open \"%s\": %s", path, strerror(errno));
+		return -1;
+	}
+
+	while (getline(&buf, &len, f) >= 0) {
+		line++;
+		if ((hash = strchr(buf, '#')))
+			*hash = '\0';
+
+		if (!(tok = strtok_r(buf, delims, &save)))
+			continue;
+
+		for (i = 0; i < count; i++) {
+			if (strcmp(r[i].serial_port, tok) == 0) {
+				eprint("CONFIG: %s:%zu: \"%s\" has a line already",
+				       path, line, tok);
+				goto err;
+			}
+		}
+
+		r = sta_realloc(r, (count + 1) * sizeof(*r));
+		route = &r[count++];
+		route->serial_port = sta_strdup(tok);
+		route->midi_port_count = 0;
+
+		while ((tok = strtok_r(NULL, delims, &save))) {
+			if (route->midi_port_count == OUTPUT_MAX) {
+				eprint("CONFIG: %s:%zu: at most %d MIDI ports",
+				       path, line, OUTPUT_MAX);
+				goto err;
+			}
+
+			for (i = 0; i < route->midi_port_count; i++) {
+				if (strcmp(route->midi_ports[i], tok) == 0) {
+					eprint("CONFIG: %s:%zu: \"%s\" twice",
+					       path, line, tok);
+					goto err;
+				}
+			}
+
+			route->midi_ports[route->midi_port_count++] = sta_strdup(tok);
+		}
+
+		if (!route->midi_port_count) {
+			eprint("CONFIG: %s:%zu: \"%s\" has no MIDI port",
+			       path, line, route->serial_port);
+			goto err;
+		}
+	}
+
+	if (ferror(f)) {
+		eprint("CONFIG: cannot read \"%s\": %s", path, strerror(errno));
+		goto err;
+	}
+
+	if (!count) {
+		eprint("CONFIG: no serial port in \"%s\"", path);
+		goto err;
+	}
+
+	free(buf);
+	fclose(f);
+	*routes = r;
+	return count;
+
+err:
+	free(buf);
+	fclose(f);
+	config_free(r, count);
+	return -1;
+}
+
+/*
+ * The MIDI port called name, added to the count in ports if it's new. A
+ * name such as "fifo:/tmp/midi" makes it a sink other than rawmidi.
+ */
+static struct sta_port * port_get(struct sta_port *ports, size_t *count,
+                                  const char *name)
+{
+	struct sta_port *p;
+	size_t i, len;
+
+	for (i = 0; i < *count; i++) {
+		if (strcmp(ports[i].name, name) == 0)
+			return &ports[i];
+	}
+
+	p = &ports[(*count)++];
+	p->name = name;
+	p->sink = SINK_RAWMIDI;
+	p->path = NULL;
+	p->fd = -1;
+	p->rawmidi = NULL;
+	p->pfds = NULL;
+	p->nfds = 0;
+	p->buffer = 0;
+	p->busy = NULL;
+	p->pending = false;
+	p->watched = false;
+
+	for (i = SINK_RAWMIDI + 1; i <= SINK_NULL; i++) {
+		len = strlen(sink_names[i]);
+		if (strncmp(name, sink_names[i], len) == 0 && name[len] == ':') {
+			p->sink = i;
+			p->path = name + len + 1;
+			break;
+		}
+	}
+
+	return p;
+}
+
+/*
+ * Sets up everything about a serial port but what has to be opened, with
+ * an output for each MIDI port of route. Those are looked for in the count
+ * in ports and added there if they are new, to be opened later on.
+ */
+static void bridge_init(struct sta_userdata *u, const struct sta_route *route,
+                        struct sta_port *ports, size_t *count)
+{
+	struct sta_output *o;
+	size_t i, j;
+
+	u->serial_port = route->serial_port;
+	u->output_count = route->midi_port_count;
+	u->wait_pfds = NULL;
+	u->seq = NULL;
+	u->seq_enc = NULL;
+	u->seq_queue = -1;
+	u->seq_base = 0;
+	u->seq_sync = 0;
+	u->seq_last = 0;
+	u->fd = -1;
+	u->inotify_fd = -1;
+	u->wd = -1;
+	u->lost = 0;
+	u->rx_len = 0;
+	u->room_fd = -1;
+	u->stop_fd = -1;
+	u->pending_count = 0;
+	u->overflowing = false;
+	atomic_init(&u->room_wanted, false);
+	u->ring.data = NULL;
+	u->ret.data = NULL;
+	u->input = NULL;
+	memset(&u->midi, 0, sizeof(u->midi));
+	u->out_fd = -1;
+	u->ret_data_fd = -1;
+	u->ret_room_fd = -1;
+	u->tx = NULL;
+	u->tx_len = 0;
+	u->tx_off = 0;
+	u->tx_frames = 0;
+	u->tx_stamps = NULL;
+	u->tx_lost = false;
+	atomic_init(&u->ret_data_wanted, false);
+	atomic_init(&u->ret_room_wanted, false);
+	atomic_init(&u->stats.reads, 0);
+	atomic_init(&u->stats.frames, 0);
+	atomic_init(&u->stats.malformed, 0);
+	atomic_init(&u->stats.corrupt, 0);
+	atomic_init(&u->stats.blocked, 0);
+	atomic_init(&u->stats.blocked_ns, 0);
+	atomic_init(&u->stats.dropped_oldest, 0);
+	atomic_init(&u->stats.dropped_newest, 0);
+	atomic_init(&u->stats.coalesced, 0);
+	atomic_init(&u->stats.ret_frames, 0);
+	atomic_init(&u->stats.ret_bytes, 0);
+	atomic_init(&u->stats.ret_writes, 0);
+	atomic_init(&u->stats.ret_dropped, 0);
+	atomic_init(&u->stats.ret_xruns, 0);
+	for (i = 0; i < L_COUNT; i++)
+		hist_init(&u->latency[i]);
+
+	for (i = 0; i < u->output_count; i++) {
+		o = &u->outputs[i];
+		o->u = u;
+		o->port = port_get(ports, count, route->midi_ports[i]);
+		o->cursor = i;
+		o->data_fd = -1;
+		atomic_init(&o->data_wanted, false);
+		o->batch = sta_malloc(options.batch_size);
+		o->batch_stamps = sta_malloc(options.batch_size *
+		                             sizeof(*o->batch_stamps));
+		o->batch_lens = sta_malloc(options.batch_size *
+		                           sizeof(*o->batch_lens));
+		o->batch_len = 0;
+		o->batch_off = 0;
+		o->batch_frames = 0;
+		o->stalled = 0;
+		o->status_at = 0;
+		hist_init(&o->kernel_queue);
+		o->first_write = 0;
+		o->last_write = 0;
+		atomic_init(&o->sent_frames, 0);
+		atomic_init(&o->sent_bytes, 0);
+		atomic_init(&o->writes, 0);
+		atomic_init(&o->stalls, 0);
+		atomic_init(&o->stalled_ns, 0);
+		atomic_init(&o->seq_late, 0);
+		atomic_init(&o->collapsed, 0);
+		for (j = 0; j < L_RET_QUEUE; j++)
+			hist_init(&o->latency[j]);
+	}
+
+	ring_init(&u->ring, options.buffer_size, u->output_count);
+	if (options.ret) {
+		ring_init(&u->ret, options.buffer_size, 1);
+		u->tx = sta_malloc(TX_SIZE);
+		/* an encoded frame is at least 2 bytes */
+		u->tx_stamps = sta_malloc(TX_SIZE / 2 * sizeof(*u->tx_stamps));
+	}
+}
+
+/*
+ * Opens a serial port, once the MIDI ports it's routed to are, and the
+ * eventfds its threads wake each other up with. Returns a negative error
+ * code if it can't.
+ */
+static int bridge_open(struct sta_userdata *u, int stop_fd)
+{
+	size_t i;
+	int nfds = 0;
+
+	/* every output's descriptors, and stop_fd */
+	for (i = 0; i < u->output_count; i++)
+		nfds += u->outputs[i].port->nfds;
+	u->wait_pfds = sta_malloc((nfds + 1) * sizeof(*u->wait_pfds));
+
+	if ((u->fd = serial_setup(u->serial_port)) < 0)
+		return u->fd;
+
+	u->stop_fd = stop_fd;
+	if ((u->room_fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK)) < 0)
+		goto err;
+
+	for (i = 0; i < u->output_count; i++) {
+		if ((u->outputs[i].data_fd = eventfd(0, EFD_CLOEXEC |
+		                                        EFD_NONBLOCK)) < 0)
+			goto err;
+	}
+
+	if (options.ret &&
+	    ((u->ret_data_fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK)) < 0 ||
+	     (u->ret_room_fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK)) < 0))
+		goto err;
+
+	return 0;
+
+err:
+	eprint("THREAD: cannot create eventfd: %s", strerror(errno));
+	return -errno;
+}
+
+/* Closes and frees what bridge_init() and bridge_open() set up. */
+static void bridge_free(struct sta_userdata *u)
+{
+	struct sta_output *o;
+	size_t i;
+
+	if (u->room_fd >= 0)
+		close(u->room_fd);
+
+	if (u->ret_data_fd >= 0)
+		close(u->ret_data_fd);
+
+	if (u->ret_room_fd >= 0)
+		close(u->ret_room_fd);
+
+	if (u->out_fd >= 0)
+		close(u->out_fd);
+
+	if (u->input)
+		snd_rawmidi_close(u->input);
+
+	for (i = 0; i < u->output_count; i++) {
+		o = &u->outputs[i];
+
+		if (o->data_fd >= 0)
+			close(o->data_fd);
+
+		free(o->batch);
+		free(o->batch_stamps);
+		free(o->batch_lens);
+	}
+
+	if (u->seq_enc)
+		snd_midi_event_free(u->seq_enc);
+
+	if (u->seq) {
+		if (u->seq_queue >= 0)
+			snd_seq_free_queue(u->seq, u->seq_queue);
+		snd_seq_close(u->seq);
+	}
+
+	if (u->fd >= 0)
+		close(u->fd);
+
+	if (u->inotify_fd >= 0)
+		close(u->inotify_fd);
+
+	ring_free(&u->ring);
+	ring_free(&u->ret);
+	free(u->wait_pfds);
+	free(u->tx);
+	free(u->tx_stamps);
+}
+
+int main(int argc, char *argv[])
+{
+	enum {
+		OPT_SERIAL_SCHED = 256,
+		OPT_ALSA_SCHED,
+		OPT_SERIAL_CPUS,
+		OPT_ALSA_CPUS,
+		OPT_BATCH_SIZE,
+		OPT_BATCH_WAIT,
+		OPT_COLLAPSE,
+		OPT_SERIAL_MODE,
+		OPT_VMIN,
+		OPT_VTIME,
+		OPT_FRAMING,
+		OPT_CRC,
+		OPT_NO_RECONNECT,
+		OPT_RTSCTS,
+		OPT_LOW_LATENCY,
+		OPT_RX_TRIGGER,
+		OPT_BACKEND,
+		OPT_SEQ_DELAY,
+		OPT_ALSA_BUFFER,
+		OPT_ALSA_AVAIL_MIN,
+		OPT_NO_ACTIVE_SENSING,
+		OPT_WORKERS,
+	};
+	static const char short_options[] = "hVm:s:c:B:b:O:rqe:R";
+	static const struct option long_options[] = {
+		{"help", no_argument, NULL, 'h'},
+		{"version", no_argument, NULL, 'V'},
+		{"midi-port", required_argument, NULL, 'm'},
+		{"serial-port", required_argument, NULL, 's'},
+		{"config", required_argument, NULL, 'c'},
+		{"workers", required_argument, NULL, OPT_WORKERS},
+		{"buffer-size", required_argument, NULL, 'b'},
+		{"baud-rate", required_argument, NULL, 'B'},
+		{"framing", required_argument, NULL, OPT_FRAMING},
+		{"crc", required_argument, NULL, OPT_CRC},
+		{"no-reconnect", no_argument, NULL, OPT_NO_RECONNECT},
+		{"rtscts", no_argument, NULL, OPT_RTSCTS},
+		{"low-latency", no_argument, NULL, OPT_LOW_LATENCY},
+		{"rx-trigger", required_argument, NULL, OPT_RX_TRIGGER},
+		{"return", no_argument, NULL, 'r'},
+		{"serial-mode", required_argument, NULL, OPT_SERIAL_MODE},
+		{"vmin", required_argument, NULL, OPT_VMIN},
+		{"vtime", required_argument, NULL, OPT_VTIME},
+		{"overflow", required_argument, NULL, 'O'},
+		{"quiet", no_argument, NULL, 'q'},
+		{"batch-size", required_argument, NULL, OPT_BATCH_SIZE},
+		{"batch-wait", required_argument, NULL, OPT_BATCH_WAIT},
+		{"collapse", no_argument, NULL, OPT_COLLAPSE},
+		{"engine", required_argument, NULL, 'e'},
+		{"backend", required_argument, NULL, OPT_BACKEND},
+		{"seq-delay", required_argument, NULL, OPT_SEQ_DELAY},
+		{"alsa-buffer", required_argument, NULL, OPT_ALSA_BUFFER},
+		{"alsa-avail-min", required_argument, NULL, OPT_ALSA_AVAIL_MIN},
+		{"no-active-sensing", no_argument, NULL, OPT_NO_ACTIVE_SENSING},
+		{"realtime", no_argument, NULL, 'R'},
+		{"serial-sched", required_argument, NULL, OPT_SERIAL_SCHED},
+		{"alsa-sched", required_argument, NULL, OPT_ALSA_SCHED},
+		{"serial-cpus", required_argument, NULL, OPT_SERIAL_CPUS},
+		{"alsa-cpus", required_argument, NULL, OPT_ALSA_CPUS},
+		{ }
+	};
+	int c, err, sfd, stop_fd = -1;
+	bool overflow_set = false, midi_port_set = false;
+	bool serial_port_set = false, engine_set = false;
+	bool serial_sched_set = false, alsa_sched_set = false;
+	size_t i, bridge_count, port_count = 0, worker_count = 0;
+	sigset_t mask;
+	struct sta_route single, *routes;
+	struct sta_userdata *bridges, *u;
+	struct sta_port *ports, *p;
+	struct sta_worker *workers = NULL;
+
+	while ((c = getopt_long(argc, argv, short_options,
 	                        long_options, NULL)) != -1) {
 		switch (c) {
 		case 'h':
@@ -385,10 +4913,225 @@ int main(int argc, char *argv[])
 			version();
 			return 0;
 		case 'm':
-			options.midi_port_name = optarg;
+			/* the first one replaces the default */
+			if (!midi_port_set)
+				options.midi_port_count = 0;
+			midi_port_set = true;
+
+			if (options.midi_port_count == OUTPUT_MAX) {
+				eprint("At most %d MIDI ports", OUTPUT_MAX);
+				return 1;
+			}
+
+			/* each output has a thread, a port may not have two */
+			for (i = 0; i < options.midi_port_count; i++) {
+				if (strcmp(options.midi_ports[i], optarg) == 0) {
+					eprint("MIDI port \"%s\" twice", optarg);
+					return 1;
+				}
+			}
+			options.midi_ports[options.midi_port_count++] = optarg;
 			break;
 		case 's':
 			options.serial_port_name = optarg;
+			serial_port_set = true;
+			break;
+		case 'c':
+			options.config = optarg;
+			break;
+		case OPT_WORKERS:
+			if (!parse_size(optarg, &options.workers) ||
+			    !options.workers) {
+				eprint("Invalid number of workers \"%s\"", optarg);
+				return 1;
+			}
+			break;
+		case 'b':
+			/* room for the largest frame even when it has to wrap */
+			if (!parse_size(optarg, &options.buffer_size) ||
+			    options.buffer_size < 4 * READ_SIZE) {
+				eprint("Buffer size must be at least %d bytes",
+				       4 * READ_SIZE);
+				return 1;
+			}
+			break;
+		case 'B':
+			if (!parse_size(optarg, &i) || i == 0 || i > UINT_MAX) {
+				eprint("Invalid baud rate \"%s\"", optarg);
+				return 1;
+			}
+			options.baud_rate = i;
+			break;
+		case OPT_FRAMING:
+			for (i = 0; i < ARRAY_SIZE(framing_names); i++) {
+				if (strcmp(optarg, framing_names[i]) == 0)
+					break;
+			}
+			if (i == ARRAY_SIZE(framing_names)) {
+				eprint("Unknown framing \"%s\"", optarg);
+				return 1;
+			}
+			options.framing = i;
+			break;
+		case OPT_CRC:
+			for (i = 0; i < ARRAY_SIZE(crc_names); i++) {
+				if (strcmp(optarg, crc_names[i]) == 0)
+					break;
+			}
+			if (i == ARRAY_SIZE(crc_names)) {
+				eprint("Unknown CRC \"%s\"", optarg);
+				return 1;
+			}
+			options.crc = i;
+			break;
+		case OPT_NO_RECONNECT:
+			options.reconnect = false;
+			break;
+		case OPT_RTSCTS:
+			options.rtscts = true;
+			break;
+		case OPT_LOW_LATENCY:
+			options.low_latency = true;
+			break;
+		case OPT_RX_TRIGGER:
+			if (!parse_size(optarg, &options.rx_trigger)) {
+				eprint("Invalid RX FIFO trigger \"%s\"", optarg);
+				return 1;
+			}
+			options.low_latency = true;
+			break;
+		case 'r':
+			options.ret = true;
+			break;
+		case OPT_SERIAL_MODE:
+			for (i = 0; i < ARRAY_SIZE(serial_mode_names); i++) {
+				if (strcmp(optarg, serial_mode_names[i]) == 0)
+					break;
+			}
+			if (i == ARRAY_SIZE(serial_mode_names)) {
+				eprint("Unknown serial mode \"%s\"", optarg);
+				return 1;
+			}
+			options.serial_mode = i;
+			break;
+		case OPT_VMIN:
+			/* 0 would make read() return nothing on timeouts */
+			if (!parse_size(optarg, &i) || i < 1 || i > UCHAR_MAX) {
+				eprint("VMIN must be between 1 and %d", UCHAR_MAX);
+				return 1;
+			}
+			options.vmin = i;
+			break;
+		case OPT_VTIME:
+			if (!parse_size(optarg, &i) || i > UCHAR_MAX) {
+				eprint("VTIME must be between 0 and %d", UCHAR_MAX);
+				return 1;
+			}
+			options.vtime = i;
+			break;
+		case 'O':
+			for (i = 0; i < ARRAY_SIZE(overflow_names); i++) {
+				if (strcmp(optarg, overflow_names[i]) == 0)
+					break;
+			}
+			if (i == ARRAY_SIZE(overflow_names)) {
+				eprint("Unknown overflow policy \"%s\"", optarg);
+				return 1;
+			}
+			options.overflow = i;
+			overflow_set = true;
+			break;
+		case 'q':
+			options.quiet = true;
+			break;
+		case OPT_BATCH_SIZE:
+			/* the largest frame must fit */
+			if (!parse_size(optarg, &options.batch_size) ||
+			    options.batch_size < READ_SIZE) {
+				eprint("Batch size must be at least %d bytes",
+				       READ_SIZE);
+				return 1;
+			}
+			break;
+		case OPT_BATCH_WAIT:
+			if (!parse_size(optarg, &i)) {
+				eprint("Invalid batch wait \"%s\"", optarg);
+				return 1;
+			}
+			options.batch_wait = i;
+			break;
+		case OPT_COLLAPSE:
+			options.collapse = true;
+			break;
+		case 'e':
+			for (i = 0; i < ARRAY_SIZE(engine_names); i++) {
+				if (strcmp(optarg, engine_names[i]) == 0)
+					break;
+			}
+			if (i == ARRAY_SIZE(engine_names)) {
+				eprint("Unknown engine \"%s\"", optarg);
+				return 1;
+			}
+			options.engine = i;
+			engine_set = true;
+			break;
+		case OPT_BACKEND:
+			for (i = 0; i < ARRAY_SIZE(backend_names); i++) {
+				if (strcmp(optarg, backend_names[i]) == 0)
+					break;
+			}
+			if (i == ARRAY_SIZE(backend_names)) {
+				eprint("Unknown backend \"%s\"", optarg);
+				return 1;
+			}
+			options.backend = i;
+			break;
+		case OPT_SEQ_DELAY:
+			if (!parse_size(optarg, &i)) {
+				eprint("Invalid sequencer delay \"%s\"", optarg);
+				return 1;
+			}
+			options.seq_delay = i;
+			break;
+		case OPT_ALSA_BUFFER:
+			if (!parse_size(optarg, &options.alsa_buffer) ||
+			    !options.alsa_buffer) {
+				eprint("Invalid ALSA buffer size \"%s\"", optarg);
+				return 1;
+			}
+			break;
+		case OPT_ALSA_AVAIL_MIN:
+			if (!parse_size(optarg, &options.alsa_avail_min) ||
+			    !options.alsa_avail_min) {
+				eprint("Invalid ALSA avail_min \"%s\"", optarg);
+				return 1;
+			}
+			break;
+		case OPT_NO_ACTIVE_SENSING:
+			options.no_active_sensing = true;
+			break;
+		case 'R':
+			options.realtime = true;
+			break;
+		case OPT_SERIAL_SCHED:
+		case OPT_ALSA_SCHED:
+			if (!parse_sched(optarg, &options.sched[c == OPT_ALSA_SCHED ?
+			                                        T_ALSA : T_SERIAL])) {
+				eprint("Invalid scheduling \"%s\"", optarg);
+				return 1;
+			}
+			if (c == OPT_ALSA_SCHED)
+				alsa_sched_set = true;
+			else
+				serial_sched_set = true;
+			break;
+		case OPT_SERIAL_CPUS:
+		case OPT_ALSA_CPUS:
+			if (!parse_cpus(optarg, &options.sched[c == OPT_ALSA_CPUS ?
+			                                       T_ALSA : T_SERIAL])) {
+				eprint("Invalid CPU list \"%s\"", optarg);
+				return 1;
+			}
 			break;
 		default:
 			eprint("Try `serial-to-alsa --help' for more information.");
@@ -396,90 +5139,292 @@ int main(int argc, char *argv[])
 		}
 	}
 
-	signal(SIGINT, sig_handler);
+	/* -R only fills in what wasn't given, other included */
+	if (options.realtime) {
+		if (!serial_sched_set) {
+			options.sched[T_SERIAL].policy = SCHED_FIFO;
+			options.sched[T_SERIAL].priority = RT_PRIORITY_SERIAL;
+		}
+		if (!alsa_sched_set) {
+			options.sched[T_ALSA].policy = SCHED_FIFO;
+			options.sched[T_ALSA].priority = RT_PRIORITY_ALSA;
+		}
+		if (options.ret)
+			rt_return_sched();
+	}
 
-	if ((err = alsa_setup(&u.output)) < 0)
-		goto end;
+	if (options.framing != FRAMING_SENTINEL &&
+	    options.serial_mode == SERIAL_CANONICAL) {
+		eprint("%s framing needs the raw serial mode",
+		       framing_names[options.framing]);
+		return 1;
+	}
 
-	if ((u.fd = serial_setup(options.serial_port_name)) < 0) {
-		err = u.fd;
-		goto end;
+	/* dropping anything would defeat the point of flow control */
+	if (options.rtscts) {
+		if (overflow_set && options.overflow != OVERFLOW_BLOCK) {
+			eprint("--rtscts needs the block overflow policy");
+			return 1;
+		}
+		options.overflow = OVERFLOW_BLOCK;
 	}
 
-	/* Mutex */
-	if ((err = pthread_mutexattr_init(&atts)) != 0) {
-		eprint("THREAD: cannot create mutex attribute object: %s",
-		       strerror(errno));
-		goto end;
+	/* a CRC byte may be 0xFF, or 0x0A which the STM32 can't send */
+	if (options.crc && options.framing == FRAMING_SENTINEL) {
+		eprint("a CRC needs a framing other than sentinel");
+		return 1;
+	}
+
+	if (options.ret && options.backend != BACKEND_RAWMIDI) {
+		eprint("--return needs the rawmidi backend");
+		return 1;
+	}
+
+	/* anybody can subscribe to the sequencer port already */
+	if (options.backend == BACKEND_SEQ && midi_port_set) {
+		eprint("--midi-port needs the rawmidi backend");
+		return 1;
 	}
 
-	if ((err = pthread_mutexattr_settype(&atts, PTHREAD_MUTEX_RECURSIVE)) != 0) {
-		eprint("THREAD: cannot set mutex attribute: %s", strerror(errno));
-		pthread_mutexattr_destroy(&atts);
+	if (options.config) {
+		if (serial_port_set || midi_port_set) {
+			eprint("--config replaces --serial-port and --midi-port");
+			return 1;
+		}
+
+		if (options.ret) {
+			eprint("--return needs a single serial port");
+			return 1;
+		}
+
+		if (options.backend != BACKEND_RAWMIDI) {
+			eprint("--config needs the rawmidi backend");
+			return 1;
+		}
+
+		/* a thread for every port is what it's there to avoid */
+		if (engine_set && options.engine != ENGINE_EPOLL) {
+			eprint("--config needs the epoll engine");
+			return 1;
+		}
+		options.engine = ENGINE_EPOLL;
+	}
+
+	if ((err = rt_check()) < 0)
+		return 1;
+
+	if (options.config) {
+		if ((err = config_load(options.config, &routes)) < 0)
+			return 1;
+		bridge_count = err;
+	} else {
+		/* -s and -m make a configuration of a single line */
+		single.serial_port = options.serial_port_name;
+		single.midi_port_count = options.backend == BACKEND_SEQ ?
+		                         1 : options.midi_port_count;
+		for (i = 0; i < single.midi_port_count; i++) {
+			single.midi_ports[i] = options.backend == BACKEND_SEQ ?
+			                       PACKAGE_NAME : options.midi_ports[i];
+		}
+		routes = &single;
+		bridge_count = 1;
+	}
+
+	crc_init();
+
+	scan_eol_init();
+
+	/*
+	 * Signals are only taken by the main thread, through signalfd. Block
+	 * them before anything can start a thread, so all threads inherit it.
+	 */
+	sigemptyset(&mask);
+	sigaddset(&mask, SIGINT);
+	sigaddset(&mask, SIGTERM);
+	sigaddset(&mask, SIGUSR1);
+	pthread_sigmask(SIG_BLOCK, &mask, NULL);
+
+	if ((sfd = signalfd(-1, &mask, SFD_CLOEXEC)) < 0) {
+		eprint("cannot create signalfd: %s", strerror(errno));
+		return 1;
+	}
+
+	/* every MIDI port once, however many serial ports are routed to it */
+	ports = sta_malloc(bridge_count * OUTPUT_MAX * sizeof(*ports));
+	bridges = sta_malloc(bridge_count * sizeof(*bridges));
+	for (i = 0; i < bridge_count; i++)
+		bridge_init(&bridges[i], &routes[i], ports, &port_count);
+
+	/* the one there is without --config */
+	u = &bridges[0];
+
+	if (options.backend == BACKEND_SEQ) {
+		if ((err = seq_setup(u)) < 0)
+			goto end;
+
+		p = &ports[0];
+		p->nfds = snd_seq_poll_descriptors_count(u->seq, POLLOUT);
+		p->pfds = sta_malloc((p->nfds + 1) * sizeof(*p->pfds));
+		p->nfds = snd_seq_poll_descriptors(u->seq, p->pfds, p->nfds,
+		                                   POLLOUT);
+	} else {
+		/* the return path reads from the first port */
+		for (i = 0; i < port_count; i++) {
+			if ((err = alsa_setup(&ports[i], options.ret && i == 0 ?
+			                      &u->input : NULL)) < 0)
+				goto end;
+		}
+	}
+
+	if ((stop_fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK)) < 0) {
+		eprint("THREAD: cannot create eventfd: %s", strerror(errno));
+		err = -errno;
 		goto end;
 	}
 
-	/* if ((err = pthread_mutexattr_setprotocol(&atts, PTHREAD_PRIO_INHERIT)) != 0) { */
-	/* 	eprint("THREAD: cannot set mutex protocol: %s", strerror(errno)); */
-	/* 	pthread_mutexattr_destroy(&atts); */
-	/* 	goto end; */
-	/* } */
+	for (i = 0; i < bridge_count; i++) {
+		if ((err = bridge_open(&bridges[i], stop_fd)) < 0)
+			goto end;
+	}
 
-	if ((err = pthread_mutex_init(&u.mutex, &atts)) != 0) {
-		eprint("THREAD: cannot create mutex: %s", strerror(errno));
-		pthread_mutexattr_destroy(&atts);
+	/* after everything is allocated, so the ring gets locked too */
+	if (options.realtime && (err = rt_lock_memory()) < 0)
 		goto end;
+
+	/* Thread Execution */
+	if (options.engine == ENGINE_EPOLL) {
+		if (options.workers > bridge_count)
+			options.workers = bridge_count;
+
+		workers = sta_malloc(options.workers * sizeof(*workers));
+		worker_count = epoll_plan(bridges, bridge_count, ports, port_count,
+		                          workers);
+
+		if (options.config) {
+			printf("EPOLL: %zu serial ports and %zu MIDI ports on %zu "
+			       "threads\n", bridge_count, port_count, worker_count);
+		}
+
+		for (i = 0; i < worker_count; i++) {
+			if ((err = thread_create(&workers[i].t, T_SERIAL,
+			                         epoll_worker, &workers[i])) != 0) {
+				sta_stop(u);
+				epoll_join(workers, i);
+				goto end;
+			}
+		}
+
+		if (options.realtime) {
+			for (i = 0; i < worker_count; i++)
+				thread_report(workers[i].t, T_SERIAL);
+		}
+
+		signal_wait(bridges, bridge_count, sfd);
+
+		epoll_join(workers, worker_count);
+
+		goto stats;
 	}
 
-	if ((err = pthread_mutexattr_destroy(&atts)) != 0) {
-		eprint("THREAD: cannot destroy mutex attribute object: %s",
-		        strerror(errno));
-		goto mutex;
+	for (i = 0; i < u->output_count; i++) {
+		if ((err = thread_create(&u->outputs[i].t, T_ALSA, alsa_worker,
+		                         &u->outputs[i])) != 0) {
+			sta_stop(u);
+			alsa_join(u, i);
+			goto end;
+		}
 	}
 
-	/* Condition Variable */
-	if ((err = pthread_cond_init(&u.condition, NULL)) != 0) {
-		eprint("THREAD: cannot create condition variable: %s",
-		        strerror(errno));
-		goto mutex;
+	if ((err = thread_create(&u->t[T_SERIAL], T_SERIAL, serial_worker, u)) != 0) {
+		sta_stop(u);
+		alsa_join(u, u->output_count);
+		goto end;
 	}
 
-	/* Thread Execution */
-	if ((err = pthread_create(&u.t[T_ALSA], NULL, alsa_worker, &u)) != 0) {
-		eprint("THREAD: cannot create ALSA thread: %s", strerror(errno));
-		goto cond;
+	if (options.ret) {
+		if ((err = thread_create(&u->t[T_SERIAL_OUT], T_SERIAL_OUT,
+		                         serial_out_worker, u)) != 0) {
+			sta_stop(u);
+			pthread_join(u->t[T_SERIAL], NULL);
+			alsa_join(u, u->output_count);
+			goto end;
+		}
+
+		if ((err = thread_create(&u->t[T_MIDI_IN], T_MIDI_IN,
+		                         midi_in_worker, u)) != 0) {
+			sta_stop(u);
+			pthread_join(u->t[T_SERIAL_OUT], NULL);
+			pthread_join(u->t[T_SERIAL], NULL);
+			alsa_join(u, u->output_count);
+			goto end;
+		}
 	}
 
-	if ((err = pthread_create(&u.t[T_SERIAL], NULL, serial_worker, &u)) != 0) {
-		eprint("THREAD: cannot create SERIAL thread: %s", strerror(errno));
-		pthread_kill(u.t[T_ALSA], 9);
-		goto cond;
+	if (options.realtime) {
+		thread_report(u->t[T_SERIAL], T_SERIAL);
+		for (i = 0; i < u->output_count; i++)
+			thread_report(u->outputs[i].t, T_ALSA);
+		if (options.ret) {
+			thread_report(u->t[T_MIDI_IN], T_MIDI_IN);
+			thread_report(u->t[T_SERIAL_OUT], T_SERIAL_OUT);
+		}
 	}
 
+	signal_wait(u, 1, sfd);
+
 	/* Wait for threads */
-	if ((err = pthread_join(u.t[T_ALSA], NULL)) != 0) {
-		eprint("THREAD: error while waiting for ALSA thread: %s",
-		        strerror(errno));
-	}
+	alsa_join(u, u->output_count);
 
-	if ((err = pthread_join(u.t[T_SERIAL], NULL)) != 0) {
+	if ((err = pthread_join(u->t[T_SERIAL], NULL)) != 0) {
 		eprint("THREAD: error while waiting for SERIAL thread: %s",
 		        strerror(errno));
 	}
 
-cond:
-	pthread_cond_destroy(&u.condition);
+	if (options.ret) {
+		if ((err = pthread_join(u->t[T_MIDI_IN], NULL)) != 0) {
+			eprint("THREAD: error while waiting for MIDI IN thread: %s",
+			        strerror(err));
+		}
+
+		if ((err = pthread_join(u->t[T_SERIAL_OUT], NULL)) != 0) {
+			eprint("THREAD: error while waiting for SERIAL OUT "
+			       "thread: %s", strerror(err));
+		}
+	}
 
-mutex:
-	pthread_mutex_destroy(&u.mutex);
+stats:
+	for (i = 0; i < bridge_count; i++)
+		stats_print(&bridges[i]);
+	for (i = 0; i < bridge_count; i++)
+		latency_print(&bridges[i]);
 
 end:
+	if (stop_fd >= 0)
+		close(stop_fd);
+
+	close(sfd);
 
-	if (u.output)
-		snd_rawmidi_close(u.output);
+	for (i = 0; i < bridge_count; i++)
+		bridge_free(&bridges[i]);
+
+	for (i = 0; i < port_count; i++) {
+		if (ports[i].rawmidi)
+			snd_rawmidi_close(ports[i].rawmidi);
+		if (ports[i].fd >= 0)
+			close(ports[i].fd);
+		free(ports[i].pfds);
+	}
+
+	for (i = 0; i < worker_count; i++) {
+		free(workers[i].bridges);
+		free(workers[i].ports);
+	}
 
-	if (u.fd > 0)
-		close(u.fd);
+	free(workers);
+	free(bridges);
+	free(ports);
+	if (options.config)
+		config_free(routes, bridge_count);
 
 	return err;
 }
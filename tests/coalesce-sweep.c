@@ -0,0 +1,130 @@
+/*
+ *  coalesce-sweep.c - sweeps a controller into a port that doesn't take
+ *                     more with the coalesce policy, then resets it and
+ *                     sets it again, and checks the reset and the value
+ *                     after it still come out in the end, in that order,
+ *                     with each engine.
+ *
+ *  Copyright (c) 2015 ROLI Ltd.
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "sta-test.h"
+
+/* more than the FIFO and the ring hold, so most get coalesced */
+#define SWEEPS 250
+/* how long the output may stay quiet before it's done */
+#define IDLE_NS 1000000000ull
+
+static void run(const char *engine)
+{
+	const char *args[16];
+	char pty[64], fifo[64], sink[80];
+	uint8_t buf[READ_SIZE], msg[2] = { 0xB0, 0x4A }, sweep[4 * 0x80];
+	/* Reset All Controllers, then a value no sweep ends with */
+	static const uint8_t tail[] = { 0xB0, 0x79, 0x00, 0xFF,
+	                                0xB0, 0x4A, 0x40, 0xFF };
+	uint64_t idle;
+	size_t in = 0, out = 0, len = 0, n = 0, off;
+	int fd, out_fd, last = -1, reset = -1;
+	unsigned v, i;
+	ssize_t r;
+	pid_t pid;
+
+	fd = pty_open(pty, sizeof(pty));
+	out_fd = fifo_open(fifo, sizeof(fifo));
+	snprintf(sink, sizeof(sink), "fifo:%s", fifo);
+
+	args[n++] = "-q";
+	args[n++] = "-s";
+	args[n++] = pty;
+	args[n++] = "-e";
+	args[n++] = engine;
+	args[n++] = "-O";
+	args[n++] = "coalesce";
+	args[n++] = "-b";
+	args[n++] = "16384";
+	args[n++] = "-m";
+	args[n++] = sink;
+	args[n] = NULL;
+
+	pid = sta_spawn(args);
+
+	/* a whole sweep per write, 0x0A sent as 0xFA */
+	for (v = 0; v < 0x80; v++) {
+		memcpy(sweep + 4 * v, msg, 2);
+		sweep[4 * v + 2] = v == 0x0A ? 0xFA : v;
+		sweep[4 * v + 3] = 0xFF;
+	}
+
+	/* nothing is read meanwhile, the ALSA side stalls on the FIFO */
+	for (i = 0; i < SWEEPS; i++, in += 0x80) {
+		for (off = 0; off < sizeof(sweep); off += r) {
+			CHECK((r = write(fd, sweep + off,
+			                 sizeof(sweep) - off)) > 0,
+			      "cannot write to the pty: %s", strerror(errno));
+		}
+	}
+
+	CHECK(write(fd, tail, sizeof(tail)) == sizeof(tail),
+	      "cannot write to the pty: %s", strerror(errno));
+
+	/* the last values must find the ring still full */
+	sleep_us(500000);
+
+	for (idle = time_ns(); time_ns() - idle < IDLE_NS; ) {
+		if ((r = read(out_fd, buf + len, sizeof(buf) - len)) <= 0) {
+			sleep_us(1000);
+			continue;
+		}
+		idle = time_ns();
+
+		for (len += r, i = 0; i + 3 <= len; i += 3, out++) {
+			CHECK(buf[i] == 0xB0 &&
+			      (buf[i + 1] == 0x4A || buf[i + 1] == 0x79),
+			      "%s: message %zu is %02x %02x", engine, out,
+			      buf[i], buf[i + 1]);
+			if (buf[i + 1] == 0x79) {
+				reset = out;
+				last = -1;
+			} else {
+				last = buf[i + 2];
+			}
+		}
+		len -= i;
+		memmove(buf, buf + i, len);
+	}
+
+	CHECK(sta_finish(pid) == 0, "%s: serial-to-alsa failed", engine);
+	fifo_close(out_fd, fifo);
+	close(fd);
+
+	/* otherwise this proves nothing */
+	CHECK(out < in, "%s: nothing was coalesced", engine);
+	CHECK(reset >= 0, "%s: the reset never came out", engine);
+	CHECK(last == 0x40, "%s: the value after the reset is %d", engine,
+	      last);
+
+	printf("%s: %zu of %zu values came out, the reset and the last one "
+	       "in order\n", engine, out, in + 2);
+}
+
+int main(void)
+{
+	run("threads");
+	run("epoll");
+
+	return 0;
+}
@@ -0,0 +1,116 @@
+/*
+ *  collapse-order.c - gathers messages into a batch the way alsa_gather()
+ *                     does with --collapse, and checks no newer value moves
+ *                     ahead of a message it must come after.
+ *
+ *  Copyright (c) 2015 ROLI Ltd.
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "sta-test.h"
+
+#define MSGS_MAX 8
+
+struct collapse_case {
+	const char *name;
+	uint8_t in[MSGS_MAX][3];
+	/* what the batch must hold once gathered */
+	uint8_t out[MSGS_MAX][3];
+};
+
+static const struct collapse_case cases[] = {
+	{ "a newer value",
+	  { { 0xB0, 0x4A, 0x10 }, { 0xB0, 0x4A, 0x20 } },
+	  { { 0xB0, 0x4A, 0x20 } } },
+	{ "Reset All Controllers",
+	  { { 0xB0, 0x4A, 0x10 }, { 0xB0, 0x79, 0x00 }, { 0xB0, 0x4A, 0x20 } },
+	  { { 0xB0, 0x4A, 0x10 }, { 0xB0, 0x79, 0x00 },
+	    { 0xB0, 0x4A, 0x20 } } },
+	{ "All Sound Off",
+	  { { 0xE3, 0x00, 0x30 }, { 0xB3, 0x78, 0x00 }, { 0xE3, 0x00, 0x50 } },
+	  { { 0xE3, 0x00, 0x30 }, { 0xB3, 0x78, 0x00 },
+	    { 0xE3, 0x00, 0x50 } } },
+	{ "All Notes Off twice",
+	  { { 0xB0, 0x7B, 0x00 }, { 0xB0, 0x7B, 0x00 } },
+	  { { 0xB0, 0x7B, 0x00 }, { 0xB0, 0x7B, 0x00 } } },
+	{ "All Notes Off on another channel",
+	  { { 0xB0, 0x4A, 0x10 }, { 0xB1, 0x7B, 0x00 }, { 0xB0, 0x4A, 0x20 } },
+	  { { 0xB0, 0x4A, 0x20 }, { 0xB1, 0x7B, 0x00 } } },
+	{ "a note",
+	  { { 0xD2, 0x10 }, { 0x92, 0x3C, 0x40 }, { 0xD2, 0x20 } },
+	  { { 0xD2, 0x10 }, { 0x92, 0x3C, 0x40 }, { 0xD2, 0x20 } } },
+};
+
+/* Messages are 3 bytes but channel pressure and program change. */
+static size_t msg_len(const uint8_t *msg)
+{
+	return (msg[0] & 0xE0) == 0xC0 ? 2 : 3;
+}
+
+static void run(const struct collapse_case *c)
+{
+	static uint8_t batch[MSGS_MAX * 3];
+	static struct sta_stamp stamps[MSGS_MAX];
+	static uint16_t lens[MSGS_MAX];
+	struct sta_output o;
+	size_t n = 0, frames = 0, off, len, i;
+
+	memset(&o, 0, sizeof(o));
+	o.batch = batch;
+	o.batch_stamps = stamps;
+	o.batch_lens = lens;
+	atomic_init(&o.collapsed, 0);
+
+	for (i = 0; i < MSGS_MAX && c->in[i][0]; i++) {
+		len = msg_len(c->in[i]);
+		memcpy(o.batch + n, c->in[i], len);
+		o.batch_lens[frames] = len;
+		if (alsa_collapse(&o, n, frames))
+			continue;
+
+		n += len;
+		frames++;
+	}
+
+	for (i = 0, off = 0; i < MSGS_MAX && c->out[i][0]; i++) {
+		len = msg_len(c->out[i]);
+		CHECK(i < frames && o.batch_lens[i] == len &&
+		      memcmp(o.batch + off, c->out[i], len) == 0,
+		      "%s: message %zu isn't %02x %02x", c->name, i,
+		      c->out[i][0], c->out[i][1]);
+		off += len;
+	}
+	CHECK(frames == i, "%s: %zu messages instead of %zu", c->name, frames,
+	      i);
+
+	printf("%s: %zu of %zu messages, in order\n", c->name, frames,
+	       frames + (size_t) stat_get(&o.collapsed));
+}
+
+int main(void)
+{
+	uint8_t msg[3] = { 0xB5, 0, 0 };
+	size_t i;
+
+	for (msg[1] = 120; msg[1] < 0x80; msg[1]++) {
+		CHECK(midi_coalesce_key(msg, sizeof(msg)) == 0,
+		      "controller %u has a coalesce key", msg[1]);
+	}
+
+	for (i = 0; i < ARRAY_SIZE(cases); i++)
+		run(&cases[i]);
+
+	return 0;
+}
@@ -0,0 +1,91 @@
+/*
+ *  config-load.c - checks what config_load() makes of a --config file, and
+ *                  that it refuses the ones it should.
+ *
+ *  Copyright (c) 2015 ROLI Ltd.
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "sta-test.h"
+
+/* Loads text as a config file. Returns what config_load() does. */
+static int load(const char *text, struct sta_route **routes)
+{
+	char path[] = "/tmp/sta-test.XXXXXX";
+	int fd, count;
+
+	CHECK((fd = mkstemp(path)) >= 0 &&
+	      write(fd, text, strlen(text)) == (ssize_t) strlen(text),
+	      "cannot write \"%s\": %s", path, strerror(errno));
+	close(fd);
+
+	count = config_load(path, routes);
+	unlink(path);
+
+	return count;
+}
+
+static void refused(const char *why, const char *text)
+{
+	struct sta_route *routes;
+
+	CHECK(load(text, &routes) < 0, "a file with %s was loaded", why);
+}
+
+int main(void)
+{
+	static const char good[] =
+		"# two keyboards, both also recorded\n"
+		"/dev/ttymxc1  hw:1,0  file:/tmp/midi  # the first\n"
+		"\n"
+		"   \t\n"
+		"/dev/ttymxc2\thw:2,0 file:/tmp/midi\r\n"
+		"/dev/ttymxc3 null:";
+	struct sta_route *routes;
+	int count;
+
+	CHECK((count = load(good, &routes)) == 3, "%d serial ports", count);
+
+	CHECK(strcmp(routes[0].serial_port, "/dev/ttymxc1") == 0 &&
+	      routes[0].midi_port_count == 2 &&
+	      strcmp(routes[0].midi_ports[0], "hw:1,0") == 0 &&
+	      strcmp(routes[0].midi_ports[1], "file:/tmp/midi") == 0,
+	      "the comment after a line isn't ignored");
+	CHECK(strcmp(routes[1].serial_port, "/dev/ttymxc2") == 0 &&
+	      routes[1].midi_port_count == 2 &&
+	      strcmp(routes[1].midi_ports[1], "file:/tmp/midi") == 0,
+	      "tabs and CRLF aren't taken as blanks");
+	CHECK(strcmp(routes[2].serial_port, "/dev/ttymxc3") == 0 &&
+	      routes[2].midi_port_count == 1 &&
+	      strcmp(routes[2].midi_ports[0], "null:") == 0,
+	      "the last line without a newline is lost");
+
+	config_free(routes, count);
+
+	refused("nothing but comments", "# nothing\n\n");
+	refused("a serial port without MIDI port", "/dev/ttymxc1\n");
+	refused("a serial port twice",
+	        "/dev/ttymxc1 hw:1,0\n/dev/ttymxc1 hw:2,0\n");
+	refused("a MIDI port twice on a line", "/dev/ttymxc1 hw:1,0 hw:1,0\n");
+	refused("too many MIDI ports",
+	        "/dev/ttymxc1 a: b: c: d: e: f: g: h: i:\n");
+
+	CHECK(config_load("/nonexistent/config", &routes) < 0,
+	      "a file that doesn't exist was loaded");
+
+	printf("CONFIG: every file loaded as it should\n");
+
+	return 0;
+}
@@ -0,0 +1,133 @@
+/*
+ *  fanout-stall.c - sends frames to a FIFO sink nobody reads and to a file
+ *                   sink at once, and checks the file gets every one of
+ *                   them in order.
+ *
+ *  Copyright (c) 2015 ROLI Ltd.
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "sta-test.h"
+
+/* several times what the FIFO and the ring hold */
+#define FRAMES 40000
+/* a serial-to-alsa that hangs fails the test instead of make check */
+#define TIMEOUT_S 60
+
+static pid_t child;
+
+static void timeout(int sig)
+{
+	static const char msg[] = "FAIL: serial-to-alsa hangs\n";
+	ssize_t n;
+
+	(void) sig;
+
+	kill(child, SIGKILL);
+	/* printf() isn't safe in a signal handler */
+	n = write(STDERR_FILENO, msg, sizeof(msg) - 1);
+	(void) n;
+	_exit(EXIT_FAILURE);
+}
+
+static void run(const char *engine, const char *overflow)
+{
+	const char *args[16];
+	char pty[64], fifo[64], stalled[80], file[80], path[64];
+	uint8_t frame[3], *buf;
+	size_t n = 0, i, len;
+	int fd, fifo_fd;
+	FILE *f;
+	pid_t pid;
+
+	fd = pty_open(pty, sizeof(pty));
+	/* ours is the only reader, and it never reads */
+	fifo_fd = fifo_open(fifo, sizeof(fifo));
+	snprintf(stalled, sizeof(stalled), "fifo:%s", fifo);
+	snprintf(path, sizeof(path), "%s", fifo);
+	*strrchr(path, '/') = '\0';
+	strcat(path, "/file");
+	snprintf(file, sizeof(file), "file:%s", path);
+
+	args[n++] = "-q";
+	args[n++] = "-s";
+	args[n++] = pty;
+	args[n++] = "-e";
+	args[n++] = engine;
+	args[n++] = "-O";
+	args[n++] = overflow;
+	/* a read holds more frames than this ring */
+	args[n++] = "-b";
+	args[n++] = "16384";
+	args[n++] = "-m";
+	args[n++] = stalled;
+	args[n++] = "-m";
+	args[n++] = file;
+	args[n] = NULL;
+
+	signal(SIGALRM, timeout);
+	child = pid = sta_spawn(args);
+	alarm(TIMEOUT_S);
+
+	for (i = 0; i < FRAMES; i++) {
+		frame[0] = 0x90 | (i >> 14 & 0x0F);
+		frame[1] = i >> 7 & 0x7F;
+		frame[2] = i & 0x7F;
+		pty_write_frame(fd, frame, sizeof(frame));
+	}
+
+	/* the file takes whatever comes as fast as it comes */
+	sleep_us(1000000);
+	CHECK(sta_finish(pid) == 0, "%s, %s: serial-to-alsa failed", engine,
+	      overflow);
+	alarm(0);
+
+	CHECK((f = fopen(path, "rb")), "cannot open \"%s\": %s", path,
+	      strerror(errno));
+	buf = sta_malloc(3 * FRAMES + 1);
+	len = fread(buf, 1, 3 * FRAMES + 1, f);
+	fclose(f);
+
+	CHECK(len == 3 * FRAMES, "%s, %s: the file got %zu of %d frames",
+	      engine, overflow, len / 3, FRAMES);
+	for (i = 0; i < FRAMES; i++) {
+		CHECK(((buf[3 * i] & 0x0F) << 14 | buf[3 * i + 1] << 7 |
+		       buf[3 * i + 2]) == i, "%s, %s: frame %zu is out of order",
+		      engine, overflow, i);
+	}
+
+	printf("%s, %s: the file got all %d frames\n", engine, overflow,
+	       FRAMES);
+
+	free(buf);
+	unlink(path);
+	fifo_close(fifo_fd, fifo);
+	close(fd);
+}
+
+int main(void)
+{
+	/*
+	 * The ALSA thread of the file may fall a whole ring behind, and then
+	 * a drop policy rightly drops its frames too. The epoll thread drains
+	 * the file before the policy applies.
+	 */
+	run("threads", "block");
+	run("epoll", "block");
+	run("epoll", "drop-oldest");
+	run("epoll", "drop-newest");
+
+	return 0;
+}
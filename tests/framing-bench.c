@@ -0,0 +1,259 @@
+/*
+ *  framing-bench.c - encodes MIDI messages with each framing and CRC, then
+ *                    times splitting and decoding them the way raw mode
+ *                    does, after checking every one comes back intact.
+ *
+ *  Copyright (c) 2015 ROLI Ltd.
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "sta-test.h"
+
+/* one pass over the stream, offsets from the scanner are 16 bits */
+#define STREAM_MAX 65536
+#define MSG_MAX 258
+
+struct load {
+	const char *name;
+	size_t (*make)(uint8_t *msg, size_t i);
+};
+
+static size_t note_make(uint8_t *msg, size_t i)
+{
+	msg[0] = 0x90 | (i & 0x0F);
+	msg[1] = i >> 4 & 0x7F;
+	msg[2] = i & 0x7F;
+
+	return 3;
+}
+
+static size_t sysex_make(uint8_t *msg, size_t i)
+{
+	size_t n;
+
+	msg[0] = 0xF0;
+	for (n = 1; n < MSG_MAX - 1; n++)
+		msg[n] = (i + n * 7) & 0x7F;
+	msg[n++] = 0xF7;
+
+	return n;
+}
+
+/* a note, a controller or a pitch bend, now and then a short SysEx */
+static size_t mix_make(uint8_t *msg, size_t i)
+{
+	size_t n;
+
+	switch (i % 16) {
+	case 15:
+		msg[0] = 0xF0;
+		for (n = 1; n < 17; n++)
+			msg[n] = (i + n) & 0x7F;
+		msg[n++] = 0xF7;
+		return n;
+	case 1: case 5: case 9: case 13:
+		msg[0] = 0xB0 | (i & 0x0F);
+		msg[1] = 0x4A;
+		msg[2] = i & 0x7F;
+		return 3;
+	case 3: case 11:
+		msg[0] = 0xE0 | (i & 0x0F);
+		msg[1] = i & 0x7F;
+		msg[2] = i >> 7 & 0x7F;
+		return 3;
+	default:
+		return note_make(msg, i);
+	}
+}
+
+static const struct load loads[] = {
+	{ "3-byte notes", note_make },
+	{ "MIDI mix", mix_make },
+	{ "258-byte SysEx", sysex_make },
+};
+
+/*
+ * Encodes as many messages of load as fit in stream, with the framing and
+ * CRC in options. Returns how many, puts the length of stream in len and
+ * that of the messages alone in payload.
+ */
+static size_t stream_make(const struct load *load, uint8_t *stream,
+                          size_t *len, size_t *payload)
+{
+	uint8_t msg[MSG_MAX + 2], out[2 * (MSG_MAX + 2) + 2];
+	size_t frames = 0, n;
+	ssize_t encoded;
+
+	*len = *payload = 0;
+
+	for (;;) {
+		n = load->make(msg, frames);
+		encoded = frame_encode(msg, crc_append(msg, n), out);
+		CHECK(encoded >= 0, "%s framing can't carry %s",
+		      framing_names[options.framing], load->name);
+		if (*len + encoded > STREAM_MAX)
+			break;
+
+		memcpy(stream + *len, out, encoded);
+		*len += encoded;
+		*payload += n;
+		frames++;
+	}
+
+	return frames;
+}
+
+/*
+ * Splits stream into frames, decodes them in place and checks their CRC,
+ * like serial_read() and serial_frame() do. If load isn't NULL, checks each
+ * one is the message it was made from. Returns how many frames were good.
+ */
+static size_t stream_decode(uint8_t *stream, size_t len, uint16_t *eol,
+                            const struct load *load)
+{
+	uint8_t msg[MSG_MAX];
+	size_t start = 0, good = 0, n, i, flen;
+	ssize_t decoded;
+
+	if (options.framing == FRAMING_LENGTH) {
+		for (start = 0; start + 2 <= len; start += 2 + n) {
+			n = stream[start] << 8 | stream[start + 1];
+			flen = n;
+			if (options.crc && !crc_check(stream + start + 2, &flen))
+				continue;
+
+			CHECK(!load || (load->make(msg, good) == flen &&
+			      memcmp(msg, stream + start + 2, flen) == 0),
+			      "frame %zu came back different", good);
+			good++;
+		}
+
+		return good;
+	}
+
+	n = scan_eol(stream, len, framing_delim[options.framing], eol);
+	for (i = 0; i < n; start = eol[i++] + 1) {
+		/* resync delimiters, the way serial_read() skips them */
+		if (eol[i] == start && options.framing != FRAMING_SENTINEL)
+			continue;
+
+		if ((decoded = frame_decode(stream + start, eol[i] - start)) < 0)
+			continue;
+		flen = decoded;
+		if (options.crc && !crc_check(stream + start, &flen))
+			continue;
+
+		CHECK(!load || (load->make(msg, good) == flen &&
+		      memcmp(msg, stream + start, flen) == 0),
+		      "frame %zu came back different", good);
+		good++;
+	}
+
+	return good;
+}
+
+/* Returns the ns per frame stream_decode() takes on a copy of stream. */
+static double decode_time(const uint8_t *stream, size_t len, uint8_t *work,
+                          uint16_t *eol, size_t frames, uint64_t min_ns)
+{
+	uint64_t start = time_ns(), elapsed;
+	size_t runs = 0;
+
+	do {
+		memcpy(work, stream, len);
+		CHECK(stream_decode(work, len, eol, NULL) == frames,
+		      "frames went missing");
+		runs++;
+	} while ((elapsed = time_ns() - start) < min_ns);
+
+	return (double) elapsed / (runs * frames);
+}
+
+static void bench_usage(void)
+{
+	printf("Usage: framing-bench [-t ms]\n"
+	       "\n"
+	       "-t ms  how long to time each case for (default: 100)\n");
+}
+
+int main(int argc, char **argv)
+{
+	uint8_t *stream = sta_malloc(STREAM_MAX);
+	uint8_t *work = sta_malloc(STREAM_MAX);
+	uint16_t *eol = sta_malloc(STREAM_MAX * sizeof(*eol));
+	uint64_t min_ns = 100000000;
+	size_t len, payload, frames, l;
+	int c, f, crc;
+
+	while ((c = getopt(argc, argv, "ht:")) != -1) {
+		switch (c) {
+		case 't':
+			min_ns = strtoull(optarg, NULL, 0) * 1000000;
+			break;
+		case 'h':
+			bench_usage();
+			return 0;
+		default:
+			bench_usage();
+			return 1;
+		}
+	}
+
+	scan_eol_init();
+	crc_init();
+
+	printf("wire bytes over the payload and ns to split and decode, per "
+	       "frame\n");
+	printf("%-16s", "");
+	for (l = 0; l < ARRAY_SIZE(loads); l++)
+		printf("%18s", loads[l].name);
+	printf("\n");
+
+	for (f = 0; f < (int) ARRAY_SIZE(framing_names); f++) {
+		for (crc = 0; crc < (int) ARRAY_SIZE(crc_names); crc++) {
+			/* a CRC could end a sentinel frame early */
+			if (f == FRAMING_SENTINEL && crc != CRC_NONE)
+				continue;
+
+			options.framing = f;
+			options.crc = crc;
+			printf("%-8s %-7s", framing_names[f],
+			       crc ? crc_names[crc] : "");
+
+			for (l = 0; l < ARRAY_SIZE(loads); l++) {
+				frames = stream_make(&loads[l], stream, &len,
+				                     &payload);
+
+				memcpy(work, stream, len);
+				CHECK(stream_decode(work, len, eol, &loads[l]) ==
+				      frames, "%s framing lost frames of %s",
+				      framing_names[f], loads[l].name);
+
+				printf("%8.2f B %6.1f ns",
+				       (double) (len - payload) / frames,
+				       decode_time(stream, len, work, eol, frames,
+				                   min_ns));
+				fflush(stdout);
+			}
+			printf("\n");
+		}
+	}
+
+	free(eol);
+	free(work);
+	free(stream);
+
+	return 0;
+}
@@ -0,0 +1,216 @@
+/*
+ *  pty-bench.c - feeds serial-to-alsa numbered frames through a pty at a
+ *                given rate and times each one until it comes out of a
+ *                FIFO sink, to compare options end to end.
+ *
+ *  Copyright (c) 2015 ROLI Ltd.
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "sta-test.h"
+
+/* a frame is a note on, its number in the channel and both data bytes */
+#define SEQ_MAX (1 << 18)
+/* how long the output may stay quiet before what's missing is lost */
+#define IDLE_NS 2000000000ull
+
+struct bench {
+	int fifo;
+	size_t frames;
+	uint64_t *written; /* when each frame was written to the pty */
+	atomic_size_t done;
+	uint64_t last;     /* when the last frame came out */
+	size_t out;
+	size_t disorder;
+	struct sta_hist latency;
+};
+
+static void * reader(void *data)
+{
+	struct bench *b = data;
+	struct pollfd pfd = { .fd = b->fifo, .events = POLLIN };
+	uint8_t buf[READ_SIZE], frame[3];
+	size_t len = 0, next = 0, seq;
+	uint64_t now, idle = 0;
+	ssize_t n, i;
+
+	while (b->out < b->frames) {
+		if (poll(&pfd, 1, 100) <= 0) {
+			/* once everything was written, give up after a while */
+			if (!atomic_load(&b->done))
+				continue;
+			now = time_ns();
+			if (!idle)
+				idle = now;
+			if (now - idle > IDLE_NS)
+				break;
+			continue;
+		}
+		idle = 0;
+
+		if ((n = read(b->fifo, buf, sizeof(buf))) <= 0)
+			continue;
+		now = time_ns();
+
+		for (i = 0; i < n; i++) {
+			frame[len++] = buf[i];
+			if (len < sizeof(frame))
+				continue;
+			len = 0;
+
+			/* a gap is lost frames, only going back is disorder */
+			seq = (frame[0] & 0x0F) << 14 | frame[1] << 7 | frame[2];
+			if (seq < next)
+				b->disorder++;
+			else
+				next = seq + 1;
+
+			if (seq < b->frames)
+				hist_add(&b->latency, now - b->written[seq]);
+			b->out++;
+			b->last = now;
+		}
+	}
+
+	return NULL;
+}
+
+static void bench_usage(void)
+{
+	printf("Usage: pty-bench [-n frames] [-r rate] [-- serial-to-alsa options]\n"
+	       "\n"
+	       "-n frames  how many to send (default: 10000, at most %d)\n"
+	       "-r rate    frames per second, 0 as fast as the pty takes them\n"
+	       "           (default: 1000)\n"
+	       "\n"
+	       "Frames come out of a FIFO sink, unless the options name a MIDI\n"
+	       "port or a backend: then only the report of serial-to-alsa,\n"
+	       "printed as it exits, says how it went. $STA_BIN is the one to\n"
+	       "run instead of ./serial-to-alsa.\n", SEQ_MAX);
+}
+
+int main(int argc, char **argv)
+{
+	struct bench b = { .frames = 10000 };
+	const char *args[64];
+	char pty[64], fifo[64], sink[80];
+	char pace[32];
+	unsigned long rate = 1000;
+	uint8_t frame[3];
+	uint64_t start, at;
+	size_t n = 0, i;
+	bool own_port = true;
+	pthread_t t;
+	pid_t pid;
+	int c, fd;
+
+	while ((c = getopt(argc, argv, "hn:r:")) != -1) {
+		switch (c) {
+		case 'n':
+			b.frames = strtoul(optarg, NULL, 0);
+			break;
+		case 'r':
+			rate = strtoul(optarg, NULL, 0);
+			break;
+		case 'h':
+			bench_usage();
+			return 0;
+		default:
+			bench_usage();
+			return 1;
+		}
+	}
+
+	CHECK(b.frames > 0 && b.frames <= SEQ_MAX, "-n must be 1 to %d",
+	      SEQ_MAX);
+
+	fd = pty_open(pty, sizeof(pty));
+
+	args[n++] = "-q";
+	args[n++] = "-s";
+	args[n++] = pty;
+	for (i = optind; i < (size_t) argc && n < ARRAY_SIZE(args) - 3; i++) {
+		if (strncmp(argv[i], "-m", 2) == 0 ||
+		    strncmp(argv[i], "--midi-port", 11) == 0 ||
+		    strncmp(argv[i], "--backend", 9) == 0)
+			own_port = false;
+		args[n++] = argv[i];
+	}
+
+	b.fifo = -1;
+	if (own_port) {
+		b.fifo = fifo_open(fifo, sizeof(fifo));
+		snprintf(sink, sizeof(sink), "fifo:%s", fifo);
+		args[n++] = "-m";
+		args[n++] = sink;
+	}
+	args[n] = NULL;
+
+	b.written = sta_malloc(b.frames * sizeof(*b.written));
+	hist_init(&b.latency);
+	atomic_init(&b.done, false);
+
+	pid = sta_spawn(args);
+
+	if (b.fifo >= 0)
+		CHECK(pthread_create(&t, NULL, reader, &b) == 0,
+		      "cannot create the reader");
+
+	start = time_ns();
+	for (i = 0; i < b.frames; i++) {
+		/* on a schedule, so a late frame doesn't delay the others */
+		at = start + (rate ? i * 1000000000ull / rate : 0);
+		if (at > time_ns())
+			sleep_us((at - time_ns()) / 1000);
+
+		frame[0] = 0x90 | (i >> 14 & 0x0F);
+		frame[1] = i >> 7 & 0x7F;
+		frame[2] = i & 0x7F;
+
+		b.written[i] = time_ns();
+		pty_write_frame(fd, frame, sizeof(frame));
+	}
+	atomic_store(&b.done, true);
+
+	if (b.fifo >= 0)
+		pthread_join(t, NULL);
+	else
+		sleep_us(IDLE_NS / 1000);
+
+	/* its report goes first, ours comes after it */
+	c = sta_finish(pid);
+
+	if (b.fifo >= 0) {
+		if (rate)
+			snprintf(pace, sizeof(pace), "at %lu/s", rate);
+		else
+			snprintf(pace, sizeof(pace), "flat out");
+
+		printf("BENCH: %zu frames %s: %zu out, %zu lost, %zu out of "
+		       "order, %.0f frames/s\n", b.frames, pace, b.out,
+		       b.out < b.frames ? b.frames - b.out : 0, b.disorder,
+		       b.out && b.last > start ?
+		       b.out * 1e9 / (b.last - start) : 0);
+		fflush(stdout);
+		hist_print("write -> out", &b.latency, "frames", 1e3, "us");
+
+		fifo_close(b.fifo, fifo);
+	}
+
+	free(b.written);
+	close(fd);
+
+	return c;
+}
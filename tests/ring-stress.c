@@ -0,0 +1,162 @@
+/*
+ *  ring-stress.c - a producer and consumers hammering a small ring, so it
+ *                  wraps around all the time, to check that every frame
+ *                  comes out whole, once and in order.
+ *
+ *  Copyright (c) 2015 ROLI Ltd.
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "sta-test.h"
+
+#define FRAMES (1 << 20)
+/* a few records at most, frames are up to 4 + FRAME_EXTRA bytes */
+#define RING_SIZE 256
+#define FRAME_EXTRA 37
+
+struct stress {
+	struct sta_ring ring;
+	bool drop; /* drop the oldest frame when full instead of waiting */
+	atomic_bool done;
+	uint64_t dropped;
+	pthread_t consumers[OUTPUT_MAX];
+	uint64_t got[OUTPUT_MAX];
+};
+
+struct consumer {
+	struct stress *s;
+	size_t c;
+};
+
+/* Frame seq: its number, then bytes that depend on it, of varying length. */
+static size_t frame_make(uint32_t seq, uint8_t *buf)
+{
+	size_t len = 4 + seq % FRAME_EXTRA, i;
+
+	memcpy(buf, &seq, 4);
+	for (i = 4; i < len; i++)
+		buf[i] = seq * 31 + i;
+
+	return len;
+}
+
+static void * consumer(void *data)
+{
+	struct consumer *k = data;
+	struct stress *s = k->s;
+	uint8_t buf[4 + FRAME_EXTRA], want[4 + FRAME_EXTRA];
+	struct sta_stamp stamp;
+	uint32_t seq, next = 0;
+	ssize_t len;
+	bool done;
+
+	for (;;) {
+		/* read before popping, so nothing pushed before is missed */
+		done = atomic_load(&s->done);
+
+		if ((len = ring_pop(&s->ring, k->c, buf, sizeof(buf),
+		                    &stamp)) < 0) {
+			CHECK(len == -EAGAIN, "cursor %zu: ring_pop: %s", k->c,
+			      strerror(-len));
+			if (done)
+				break;
+			sched_yield();
+			continue;
+		}
+
+		CHECK(len >= 4, "cursor %zu: a frame of %zd bytes", k->c, len);
+		memcpy(&seq, buf, 4);
+
+		/* dropping may skip frames, never go back or repeat them */
+		CHECK(s->drop ? seq >= next : seq == next,
+		      "cursor %zu: frame %" PRIu32 " after %" PRIu32, k->c, seq,
+		      next - 1);
+		CHECK((size_t) len == frame_make(seq, want) &&
+		      memcmp(buf, want, len) == 0,
+		      "cursor %zu: frame %" PRIu32 " is torn", k->c, seq);
+		CHECK(stamp.read == seq, "cursor %zu: frame %" PRIu32
+		      " has the stamp of %" PRIu64, k->c, seq, stamp.read);
+
+		next = seq + 1;
+		s->got[k->c]++;
+	}
+
+	return NULL;
+}
+
+static void stress_run(size_t cursors, bool drop)
+{
+	struct consumer k[OUTPUT_MAX];
+	struct stress s = { .drop = drop };
+	uint8_t buf[4 + FRAME_EXTRA];
+	uint64_t start = time_ns();
+	uint32_t seq;
+	size_t c, len;
+
+	ring_init(&s.ring, RING_SIZE, cursors);
+	atomic_init(&s.done, false);
+
+	for (c = 0; c < cursors; c++) {
+		k[c].s = &s;
+		k[c].c = c;
+		CHECK(pthread_create(&s.consumers[c], NULL, consumer, &k[c]) == 0,
+		      "cannot create a consumer");
+	}
+
+	for (seq = 0; seq < FRAMES; seq++) {
+		len = frame_make(seq, buf);
+
+		/*
+		 * The read time is only carried along, the sequence will do.
+		 * Only some frames drop instead of giving the consumers a
+		 * chance, or with a single CPU they'd get none or all of them.
+		 */
+		while (!ring_push(&s.ring, buf, len, seq)) {
+			if (drop && seq % 4 == 0 && ring_drop(&s.ring))
+				s.dropped++;
+			else
+				sched_yield();
+		}
+	}
+
+	atomic_store(&s.done, true);
+
+	for (c = 0; c < cursors; c++) {
+		pthread_join(s.consumers[c], NULL);
+
+		/* a frame taken while it was dropped counts twice */
+		CHECK(drop ? s.got[c] + s.dropped >= FRAMES :
+		      s.got[c] == FRAMES, "cursor %zu got %" PRIu64
+		      " frames and %" PRIu64 " were dropped, of %d", c,
+		      s.got[c], s.dropped, FRAMES);
+	}
+
+	printf("RING: %zu cursors, %s: %d frames, %" PRIu64 " dropped, in "
+	       "%.0f ms\n", cursors, drop ? "drop-oldest" : "block", FRAMES,
+	       s.dropped, (time_ns() - start) / 1e6);
+
+	ring_free(&s.ring);
+}
+
+int main(int argc, char **argv)
+{
+	stress_run(1, false);
+	stress_run(3, false);
+	/* frames torn by a drop while copied must never come out */
+	stress_run(1, true);
+	stress_run(2, true);
+
+	return 0;
+}
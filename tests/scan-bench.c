@@ -0,0 +1,198 @@
+/*
+ *  scan-bench.c - times each frame delimiter scanner against the scalar one
+ *                 and the memchr() loop they replaced, after checking they
+ *                 all find the same delimiters.
+ *
+ *  Copyright (c) 2015 ROLI Ltd.
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "sta-test.h"
+
+/* the most a scanner is given, offsets are 16 bits */
+#define SCAN_MAX 65536
+#define DELIM 0xFF
+
+typedef size_t (*scan_fn)(const uint8_t *, size_t, uint8_t, uint16_t *);
+
+/* What raw mode did before the scanners: one memchr() per frame. */
+static size_t scan_eol_memchr(const uint8_t *buf, size_t len, uint8_t delim,
+                              uint16_t *eol)
+{
+	const uint8_t *p = buf, *end = buf + len;
+	size_t n = 0;
+
+	while (p < end && (p = memchr(p, delim, end - p))) {
+		eol[n++] = p - buf;
+		p++;
+	}
+
+	return n;
+}
+
+static const struct {
+	const char *name;
+	scan_fn scan;
+} scanners[] = {
+	{ "scalar", scan_eol_scalar },
+	{ "memchr", scan_eol_memchr },
+#if defined(__x86_64__) || defined(__i386__)
+	{ "sse2", scan_eol_sse2 },
+	{ "avx2", scan_eol_avx2 },
+#elif defined(__ARM_NEON)
+	{ "neon", scan_eol_neon },
+#endif
+};
+
+/* Whether the CPU we run on has what scanner s is built for. */
+static bool scanner_usable(size_t s)
+{
+#if defined(__x86_64__) || defined(__i386__)
+	if (scanners[s].scan == scan_eol_sse2)
+		return __builtin_cpu_supports("sse2");
+	if (scanners[s].scan == scan_eol_avx2)
+		return __builtin_cpu_supports("avx2");
+#endif
+	return true;
+}
+
+/* Fills buf with frames of frame bytes, each one ending with DELIM. */
+static void frames_fill(uint8_t *buf, size_t len, size_t frame)
+{
+	size_t i;
+
+	for (i = 0; i < len; i++)
+		buf[i] = i % frame == frame - 1 ? DELIM : rand() & 0x7F;
+}
+
+/* Checks every usable scanner against the scalar one on random data. */
+static void scanners_check(uint8_t *buf, uint16_t *want, uint16_t *got)
+{
+	size_t round, len, n, s, i;
+
+	for (round = 0; round < 2000; round++) {
+		len = rand() % 300;
+		/* sometimes sparse, sometimes nothing but delimiters */
+		for (i = 0; i < len; i++)
+			buf[i] = rand() % (round % 4 + 2) ? rand() & 0xFE : DELIM;
+
+		n = scan_eol_scalar(buf, len, DELIM, want);
+		for (s = 1; s < ARRAY_SIZE(scanners); s++) {
+			if (!scanner_usable(s))
+				continue;
+			CHECK(scanners[s].scan(buf, len, DELIM, got) == n &&
+			      memcmp(want, got, n * sizeof(*got)) == 0,
+			      "%s disagrees with scalar on %zu bytes",
+			      scanners[s].name, len);
+		}
+	}
+}
+
+/* Returns how many GB/s scan goes through len bytes of buf at. */
+static double scan_rate(scan_fn scan, const uint8_t *buf, size_t len,
+                        uint16_t *eol, uint64_t min_ns)
+{
+	uint64_t start = time_ns(), elapsed;
+	size_t runs = 0, found = 0;
+
+	do {
+		found += scan(buf, len, DELIM, eol);
+		runs++;
+	} while ((elapsed = time_ns() - start) < min_ns);
+
+	/* keeps the calls from being optimized away */
+	CHECK(found, "no delimiter found");
+
+	return (double) runs * len / elapsed;
+}
+
+static void bench_usage(void)
+{
+	printf("Usage: scan-bench [-t ms]\n"
+	       "\n"
+	       "-t ms  how long to time each case for (default: 100)\n");
+}
+
+int main(int argc, char **argv)
+{
+	static const size_t sizes[] = { 4096, 16384, SCAN_MAX };
+	static const struct {
+		const char *name;
+		size_t frame;
+	} loads[] = {
+		{ "3-byte frames", 4 },
+		{ "1000-byte SysEx", 1001 },
+	};
+	uint8_t *buf = sta_malloc(SCAN_MAX);
+	uint16_t *want = sta_malloc(SCAN_MAX * sizeof(*want));
+	uint16_t *got = sta_malloc(SCAN_MAX * sizeof(*got));
+	uint64_t min_ns = 100000000;
+	size_t l, z, s;
+	int c;
+
+	while ((c = getopt(argc, argv, "ht:")) != -1) {
+		switch (c) {
+		case 't':
+			min_ns = strtoull(optarg, NULL, 0) * 1000000;
+			break;
+		case 'h':
+			bench_usage();
+			return 0;
+		default:
+			bench_usage();
+			return 1;
+		}
+	}
+
+	srand(1);
+	scan_eol_init();
+	scanners_check(buf, want, got);
+
+	printf("GB/s          ");
+	for (s = 0; s < ARRAY_SIZE(scanners); s++)
+		printf("%8s", scanners[s].name);
+	printf("\n");
+
+	for (l = 0; l < ARRAY_SIZE(loads); l++) {
+		frames_fill(buf, SCAN_MAX, loads[l].frame);
+		printf("%s\n", loads[l].name);
+
+		for (z = 0; z < ARRAY_SIZE(sizes); z++) {
+			printf("  %5zu bytes ", sizes[z]);
+			for (s = 0; s < ARRAY_SIZE(scanners); s++) {
+				if (!scanner_usable(s)) {
+					printf("%8s", "-");
+					continue;
+				}
+				printf("%8.2f", scan_rate(scanners[s].scan, buf,
+				                          sizes[z], got, min_ns));
+				fflush(stdout);
+			}
+			printf("\n");
+		}
+	}
+
+	/* the one serial-to-alsa picks here */
+	for (s = 0; s < ARRAY_SIZE(scanners); s++) {
+		if (scanners[s].scan == scan_eol)
+			printf("serial-to-alsa uses %s\n", scanners[s].name);
+	}
+
+	free(got);
+	free(want);
+	free(buf);
+
+	return 0;
+}
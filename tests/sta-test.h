@@ -0,0 +1,164 @@
+/*
+ *  sta-test.h - shared by the tests and benchmarks of serial-to-alsa.
+ *
+ *  Copyright (c) 2015 ROLI Ltd.
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef STA_TEST_H
+#define STA_TEST_H
+
+/*
+ * serial-to-alsa is a single file of static functions: a test is built
+ * from it, with its main out of the way, so it can call them directly.
+ */
+#define main sta_main
+#include "../serial-to-alsa.c"
+#undef main
+
+#include <sys/wait.h>
+
+/* Fails the test with a message unless cond holds. */
+#define CHECK(cond, format, ...)					\
+	do {								\
+		if (!(cond)) {						\
+			eprint("FAIL: " format, ##__VA_ARGS__);		\
+			exit(EXIT_FAILURE);				\
+		}							\
+	} while (0)
+
+/*
+ * Opens a pseudo-terminal to stand in for a serial port, raw on our side,
+ * and puts the name of the other side in name. Returns our fd.
+ */
+static inline int pty_open(char *name, size_t size)
+{
+	struct termios tio;
+	int fd;
+
+	CHECK((fd = posix_openpt(O_RDWR | O_NOCTTY | O_CLOEXEC)) >= 0 &&
+	      grantpt(fd) == 0 && unlockpt(fd) == 0 &&
+	      ptsname_r(fd, name, size) == 0, "cannot open a pty: %s",
+	      strerror(errno));
+
+	CHECK(tcgetattr(fd, &tio) == 0, "cannot get pty attributes: %s",
+	      strerror(errno));
+	cfmakeraw(&tio);
+	CHECK(tcsetattr(fd, TCSANOW, &tio) == 0,
+	      "cannot set pty attributes: %s", strerror(errno));
+
+	return fd;
+}
+
+/* Sleeps for us microseconds. */
+static inline void sleep_us(uint64_t us)
+{
+	struct timespec ts = {
+		.tv_sec = us / 1000000,
+		.tv_nsec = us % 1000000 * 1000,
+	};
+
+	while (nanosleep(&ts, &ts) < 0 && errno == EINTR)
+		;
+}
+
+/*
+ * Writes a frame to a pty the way the STM32 sends it: sentinel framing,
+ * 0x0A as 0xFA and 0xFF at the end.
+ */
+static inline void pty_write_frame(int fd, const uint8_t *buf, size_t len)
+{
+	uint8_t wire[READ_SIZE];
+	size_t i, off;
+	ssize_t n;
+
+	for (i = 0; i < len && i < sizeof(wire) - 1; i++)
+		wire[i] = buf[i] == 0x0A ? 0xFA : buf[i];
+	wire[i++] = 0xFF;
+
+	for (off = 0; off < i; off += n) {
+		CHECK((n = write(fd, wire + off, i - off)) > 0,
+		      "cannot write to the pty: %s", strerror(errno));
+	}
+}
+
+/*
+ * Creates a FIFO in a directory of its own for serial-to-alsa to write to
+ * and puts its path in path. Returns our end of it, non-blocking.
+ */
+static inline int fifo_open(char *path, size_t size)
+{
+	char dir[] = "/tmp/sta-test.XXXXXX";
+	int fd;
+
+	CHECK(mkdtemp(dir), "cannot create a directory: %s", strerror(errno));
+	snprintf(path, size, "%s/out", dir);
+	CHECK(mkfifo(path, 0600) == 0 &&
+	      (fd = open(path, O_RDONLY | O_NONBLOCK)) >= 0,
+	      "cannot create FIFO \"%s\": %s", path, strerror(errno));
+
+	return fd;
+}
+
+/* Closes a FIFO from fifo_open() and removes it with its directory. */
+static inline void fifo_close(int fd, char *path)
+{
+	close(fd);
+	unlink(path);
+	*strrchr(path, '/') = '\0';
+	rmdir(path);
+}
+
+/*
+ * Starts serial-to-alsa, the one in the build tree or $STA_BIN, with args,
+ * which end with NULL. Returns its pid.
+ */
+static inline pid_t sta_spawn(const char **args)
+{
+	const char *bin = getenv("STA_BIN") ? getenv("STA_BIN") :
+	                  "./serial-to-alsa";
+	const char *argv[64] = { bin };
+	size_t i;
+	pid_t pid;
+
+	for (i = 0; args[i] && i < ARRAY_SIZE(argv) - 2; i++)
+		argv[i + 1] = args[i];
+	argv[i + 1] = NULL;
+
+	CHECK((pid = fork()) >= 0, "cannot fork: %s", strerror(errno));
+	if (pid == 0) {
+		execv(bin, (char **) argv);
+		eprint("cannot run \"%s\": %s", bin, strerror(errno));
+		_exit(127);
+	}
+
+	/* long enough to open its ports */
+	sleep_us(300000);
+	return pid;
+}
+
+/* Asks serial-to-alsa to stop, as Ctrl-C would. Returns its exit status. */
+static inline int sta_finish(pid_t pid)
+{
+	int status;
+
+	kill(pid, SIGINT);
+	CHECK(waitpid(pid, &status, 0) == pid, "cannot wait for %d: %s",
+	      pid, strerror(errno));
+
+	return WIFEXITED(status) ? WEXITSTATUS(status) : 128 + WTERMSIG(status);
+}
+
+#endif
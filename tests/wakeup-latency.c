@@ -0,0 +1,128 @@
+/*
+ *  wakeup-latency.c - measures the worst time a queued frame waits before
+ *                     the ALSA side takes it, with both engines, for
+ *                     frames that come in bursts and after idle gaps.
+ *
+ *  Copyright (c) 2015 ROLI Ltd.
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "sta-test.h"
+
+#define FRAMES 2000
+/*
+ * A frame whose wakeup got lost waits for the next one, and some come
+ * after IDLE_US of nothing: a wait that long means a lost wakeup, while
+ * even a busy machine takes a lot less to schedule a thread.
+ */
+#define IDLE_US 200000
+#define WAIT_MAX_MS 50
+
+static void run(enum sta_engine engine)
+{
+	struct sta_route route = { .midi_ports = { "null:" },
+	                           .midi_port_count = 1 };
+	struct sta_port port;
+	struct sta_userdata u;
+	struct sta_worker w;
+	struct sta_output *o = &u.outputs[0];
+	size_t port_count = 0, i;
+	uint8_t frame[4];
+	uint64_t start, max;
+	char name[64];
+	int fd, stop_fd;
+
+	options.engine = engine;
+	stop = false;
+
+	fd = pty_open(name, sizeof(name));
+	route.serial_port = name;
+
+	bridge_init(&u, &route, &port, &port_count);
+	CHECK(alsa_setup(&port, NULL) == 0, "cannot open the null sink");
+	CHECK((stop_fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK)) >= 0,
+	      "cannot create eventfd: %s", strerror(errno));
+	CHECK(bridge_open(&u, stop_fd) == 0, "cannot open \"%s\"", name);
+
+	if (engine == ENGINE_EPOLL) {
+		CHECK(epoll_plan(&u, 1, &port, port_count, &w) == 1,
+		      "not a single epoll thread");
+		CHECK(pthread_create(&w.t, NULL, epoll_worker, &w) == 0,
+		      "cannot create the epoll thread");
+	} else {
+		CHECK(pthread_create(&o->t, NULL, alsa_worker, o) == 0 &&
+		      pthread_create(&u.t[T_SERIAL], NULL, serial_worker,
+		                     &u) == 0, "cannot create the threads");
+	}
+
+	/* mostly bursts, now and then a pause, rarely a long one */
+	srand(1);
+	for (i = 0; i < FRAMES; i++) {
+		frame[0] = 0x90;
+		frame[1] = i % 8;
+		frame[2] = 0x40;
+		frame[3] = 0xFF;
+		CHECK(write(fd, frame, sizeof(frame)) == sizeof(frame),
+		      "cannot write to the pty: %s", strerror(errno));
+
+		if (rand() % 100 == 0)
+			sleep_us(IDLE_US);
+		else if (rand() % 4 == 0)
+			sleep_us(rand() % 2000);
+	}
+
+	/* the last one came after a burst, it must not wait for another */
+	start = time_ns();
+	while (stat_get(&o->sent_frames) < FRAMES &&
+	       time_ns() - start < 5000000000ull)
+		sleep_us(1000);
+
+	sta_stop(&u);
+	if (engine == ENGINE_EPOLL) {
+		pthread_join(w.t, NULL);
+		free(w.bridges);
+		free(w.ports);
+	} else {
+		pthread_join(o->t, NULL);
+		pthread_join(u.t[T_SERIAL], NULL);
+	}
+
+	printf("WAKEUP: %s engine\n", engine_names[engine]);
+	hist_print(latency_names[L_WAIT], &o->latency[L_WAIT], "frames", 1e3,
+	           "us");
+
+	CHECK(stat_get(&o->sent_frames) == FRAMES, "%s: %" PRIu64 " frames "
+	      "of %d were sent", engine_names[engine],
+	      stat_get(&o->sent_frames), FRAMES);
+
+	max = stat_get(&o->latency[L_WAIT].max);
+	CHECK(max < WAIT_MAX_MS * 1000000ull, "%s: a frame waited %.1f ms",
+	      engine_names[engine], max / 1e6);
+
+	bridge_free(&u);
+	free(port.pfds);
+	close(stop_fd);
+	close(fd);
+}
+
+int main(int argc, char **argv)
+{
+	options.quiet = true;
+
+	run(ENGINE_THREADS);
+	run(ENGINE_EPOLL);
+
+	return 0;
+}